@@ -52,6 +52,9 @@ void SystemClock_Config(void);
 static void MX_DMA_Init(void);
 static void MX_SPI1_Init(void);
 /* USER CODE BEGIN PFP */
+extern void Stack_Paint(void);
+extern void Persist_Service(void);
+extern void Boot_FirstFrame(void);
 
 /* USER CODE END PFP */
 
@@ -67,7 +70,7 @@ static void MX_SPI1_Init(void);
 int main(void)
 {
   /* USER CODE BEGIN 1 */
-
+  Stack_Paint();
   /* USER CODE END 1 */
 
   /* MCU Configuration--------------------------------------------------------*/
@@ -76,7 +79,8 @@ int main(void)
   HAL_Init();
 
   /* USER CODE BEGIN Init */
-
+  // Before SystemClock_Config(), which restarts SysTick at this rate.
+  HAL_SetTickFreq(HAL_TICK_FREQ_100HZ);
   /* USER CODE END Init */
 
   /* Configure the system clock */
@@ -91,7 +95,9 @@ int main(void)
   MX_DMA_Init();
   MX_SPI1_Init();
   /* USER CODE BEGIN 2 */
-  HAL_Delay(500);
+  Boot_FirstFrame();
+
+  // Nothing below is needed for the first frame.
 
   // APB1
   __HAL_RCC_WWDG_CLK_DISABLE();
@@ -111,8 +117,6 @@ int main(void)
 
   HAL_PWREx_EnableUltraLowPower();
   HAL_PWREx_EnableFastWakeUp();
-
-  HAL_SetTickFreq(HAL_TICK_FREQ_100HZ);
   /* USER CODE END 2 */
 
   /* Infinite loop */
@@ -123,6 +127,7 @@ int main(void)
     /* USER CODE END WHILE */
 
     /* USER CODE BEGIN 3 */
+    Persist_Service();
   }
   /* USER CODE END 3 */
 }
@@ -249,7 +254,7 @@ void MX_GPIO_Init(void)
 
   /*Configure GPIO pin : PB1 */
   GPIO_InitStruct.Pin = GPIO_PIN_1;
-  GPIO_InitStruct.Mode = GPIO_MODE_IT_FALLING;
+  GPIO_InitStruct.Mode = GPIO_MODE_IT_RISING_FALLING;
   GPIO_InitStruct.Pull = GPIO_PULLUP;
   HAL_GPIO_Init(GPIOB, &GPIO_InitStruct);
 
@@ -2,22 +2,41 @@
 #include <stdint.h>
 #include <memory.h>
 #include <algorithm>
-#include <tuple>
+#include <array>
+#include <atomic>
+#include <new>
+
+// The CMake build generates the layout in its build directory and names it in
+// CAPN_LAYOUT_H. Builds without that step use the checked-in copy.
+#ifdef CAPN_LAYOUT_H
+#include CAPN_LAYOUT_H
+#else  // #ifdef CAPN_LAYOUT_H
+#include "layout.h"
+#endif  // #ifdef CAPN_LAYOUT_H
 
 #ifdef USE_HAL_DRIVER
 #include "stm32l0xx_hal.h"
-extern "C" SPI_HandleTypeDef hspi1;
-extern "C" DMA_HandleTypeDef hdma_spi1_tx;
 #else  // #ifdef USE_HAL_DRIVER
 struct TIM_HandleTypeDef;
+#include <math.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <thread>
 #include <chrono>
+#include <vector>
 #ifdef WIN32
 #include <Windows.h>
+#else  // #ifdef WIN32
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <ucontext.h>
+#include <unistd.h>
 #endif //#ifdef WIN32
 #endif  // #ifdef USE_HAL_DRIVER
 
+#include "drivers.h"
+
 template<size_t fbits> class fixed32 {
 
 public: 
@@ -435,42 +454,193 @@ rgb::rgb(const hsv &from) {
     }
 }
 
+// Single-producer single-consumer ring for handing items between an interrupt
+// and the code it preempts. The M0+ has no LDREX/STREX, so only plain word
+// loads and stores are used: head is written by the producer only, tail by
+// the consumer only. The producer fills a slot before publishing head and the
+// consumer reads it before publishing tail, the release/acquire pairs keep
+// the compiler (and the host CPU) from reordering across those. A full queue
+// drops the new item and counts it in dropped, which only the producer writes.
+template<typename T, size_t N> class Queue {
+public:
+    static_assert((N & (N - 1)) == 0, "Queue size must be a power of two");
+
+    bool push(const T &item) {
+        uint32_t h = head.load(std::memory_order_relaxed);
+        if (h - tail.load(std::memory_order_acquire) >= N) {
+            dropped++;
+            return false;
+        }
+        items[h & (N - 1)] = item;
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(T &item) {
+        uint32_t t = tail.load(std::memory_order_relaxed);
+        if (head.load(std::memory_order_acquire) == t) {
+            return false;
+        }
+        item = items[t & (N - 1)];
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool empty() const {
+        return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+    }
+
+    uint32_t dropped = 0;
+
+private:
+    std::atomic<uint32_t> head { 0 };
+    std::atomic<uint32_t> tail { 0 };
+    T items[N] = { };
+};
+
+// The trace ring costs RAM the release image cannot spare, the build turns it
+// on for Debug. The host always has it.
+#ifndef CAPN_TRACE
+#ifdef USE_HAL_DRIVER
+#define CAPN_TRACE 0
+#else  // #ifdef USE_HAL_DRIVER
+#define CAPN_TRACE 1
+#endif  // #ifdef USE_HAL_DRIVER
+#endif  // #ifndef CAPN_TRACE
+
+#if CAPN_TRACE
+// Binary event trace in RAM. Each entry is one word: event id, argument and
+// the low 16 bits of the millisecond tick. Back-to-back DmaStart events are
+// folded into a single entry whose argument counts the extra starts, so the
+// 100Hz frame stream does not flush everything else out of the ring. Dump RAM
+// with openocd and feed it to trace_decode to get a timeline.
+class Trace {
+public:
+    enum Event : uint8_t {
+        ButtonEdge = 1,
+        PatternChange = 2,
+        EepromSave = 3,
+        DmaStart = 4,
+        PatternFrame = 5,
+    };
+
+    static constexpr uint32_t magic = 0x45435254; // "TRCE"
+    static constexpr size_t depth = 16;
+
+    static_assert((depth & (depth - 1)) == 0, "Trace depth must be a power of two");
+
+    static void record(Event event, uint8_t arg) {
+        uint32_t stamp = now() << 16;
+#ifdef USE_HAL_DRIVER
+        uint32_t primask = __get_PRIMASK();
+        __disable_irq();
+#endif  // #ifdef USE_HAL_DRIVER
+        uint32_t &last = ring.entries[(ring.head - 1) & (depth - 1)];
+        if (event == DmaStart && ring.head != 0 &&
+            (last & 0xFF) == event && (last & 0xFF00) != 0xFF00) {
+            last = stamp | ((last + 0x100) & 0xFF00) | event;
+        } else {
+            ring.entries[ring.head++ & (depth - 1)] = stamp | (uint32_t(arg) << 8) | event;
+        }
+#ifdef USE_HAL_DRIVER
+        __set_PRIMASK(primask);
+#endif  // #ifdef USE_HAL_DRIVER
+    }
+
+    struct Ring {
+        uint32_t magic;
+        uint32_t head;
+        uint32_t entries[depth];
+    };
+
+    static Ring ring;
+
+private:
+    static uint32_t now() {
+#ifdef USE_HAL_DRIVER
+        return HAL_GetTick() & 0xFFFF;
+#else  // #ifdef USE_HAL_DRIVER
+        return static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count()) & 0xFFFF;
+#endif  // #ifdef USE_HAL_DRIVER
+    }
+};
+
+Trace::Ring Trace::ring = { Trace::magic, 0, { } };
+
+#define TRACE(event, arg) Trace::record(Trace::event, static_cast<uint8_t>(arg))
+#else  // #if CAPN_TRACE
+#define TRACE(event, arg) do { } while (0)
+#endif  // #if CAPN_TRACE
+
+template<size_t N> static consteval std::array<fixed32<20>, N> layout_column(const float (&v)[N]) {
+    std::array<fixed32<20>, N> column;
+    for (size_t c = 0; c < N; c++) {
+        column[c] = fixed32<20>(v[c]);
+    }
+    return column;
+}
+
 class Leds {
 public:
-    static constexpr size_t ledsN = 12;
+    static constexpr size_t ledsN = layout::ledsN;
     static constexpr size_t spiPaddingBytes = 64;
 
-    static constexpr std::tuple<fixed32<20>, fixed32<20>, fixed32<20>, fixed32<20>> map[ledsN] = {
-        {fixed32<20>(0.000000000000f), fixed32<20>(0.000000000000f), fixed32<20>(1.000000000000f), fixed32<20>(0.785398163398f)},
-        {fixed32<20>(0.091880693216f), fixed32<20>(0.197963213135f), fixed32<20>(0.772332122866f), fixed32<20>(0.700511333882f)},
-        {fixed32<20>(0.300700450525f), fixed32<20>(0.531201288579f), fixed32<20>(0.356442638758f), fixed32<20>(0.420808961092f)},
-        {fixed32<20>(0.300700450525f), fixed32<20>(0.240855242648f), fixed32<20>(0.557331634801f), fixed32<20>(0.947448246866f)},
-        {fixed32<20>(0.173073761058f), fixed32<20>(0.405824586927f), fixed32<20>(0.561155449758f), fixed32<20>(0.518578517019f)},
-        {fixed32<20>(0.557302114506f), fixed32<20>(0.392627039385f), fixed32<20>(0.292085112127f), fixed32<20>(1.572261434407f)},
-        {fixed32<20>(0.818573448650f), fixed32<20>(0.534500675465f), fixed32<20>(0.361259521513f), fixed32<20>(2.737267656516f)},
-        {fixed32<20>(1.000000000000f), fixed32<20>(0.428920295126f), fixed32<20>(0.617041966382f), fixed32<20>(2.717833619879f)},
-        {fixed32<20>(0.753592686376f), fixed32<20>(0.808349786969f), fixed32<20>(0.289876914397f), fixed32<20>(3.674825514208f)},
-        {fixed32<20>(0.701141109540f), fixed32<20>(0.999350514393f), fixed32<20>(0.394305272030f), fixed32<20>(4.229642688686f)},
-        {fixed32<20>(0.405965339209f), fixed32<20>(1.000000000000f), fixed32<20>(0.399002657007f), fixed32<20>(5.213568293370f)},
-        {fixed32<20>(0.354993587425f), fixed32<20>(0.801751013198f), fixed32<20>(0.292326727774f), fixed32<20>(5.782303428300f)}
-    };
+    // LED layout as one array per attribute, from layout.h which
+    // convert_points.cpp generates. Patterns touching only x and y stream
+    // through just those two arrays.
+    // Normalized position, 0..1 across the bounding box.
+    static constexpr std::array<fixed32<20>, ledsN> x = layout_column(layout::x);
+    static constexpr std::array<fixed32<20>, ledsN> y = layout_column(layout::y);
+    // Distance from the centre, 0..1.
+    static constexpr std::array<fixed32<20>, ledsN> radius = layout_column(layout::radius);
+    // Polar angle around the centre, 0..2pi.
+    static constexpr std::array<fixed32<20>, ledsN> angle = layout_column(layout::angle);
+
+    // Calls f(c, column[c]...) for every LED, with only the columns given.
+    template<typename F, typename... T> static constexpr void each(F f, const std::array<T, ledsN> &... columns) {
+        for (size_t c = 0; c < ledsN; c++) {
+            f(c, columns[c]...);
+        }
+    }
 
     static Leds &instance();
 
     void transfer();
 
+    // From SysTick before transfer(). False when the previous frame was
+    // still being clocked out, transfer() then cuts it short.
+    bool sent() {
+        bool done = !started;
+        for (uint32_t ms; completed.pop(ms); ) {
+            done = true;
+        }
+        return done;
+    }
+
+    // Filled from the SPI DMA complete interrupt with the frame time it
+    // finished in.
+    static Queue<uint32_t, 2> completed;
+
     static rgb led_buffer[ledsN * 3];
 
+    // Output gain per LED, brightness times calibration, 2048 is full.
+    static uint16_t gain[ledsN];
+
 private:
 
     static uint8_t spi_buffer[ledsN * sizeof(uint16_t) * 3 * 4 + spiPaddingBytes];
 
     void init();
     bool initialized = false;
+    bool started = false;
 };
 
+Queue<uint32_t, 2> Leds::completed;
+
 uint8_t Leds::spi_buffer[ledsN * sizeof(uint16_t) * 3 * 4 + spiPaddingBytes];
 rgb Leds::led_buffer[ledsN * 3];
+uint16_t Leds::gain[ledsN] = { };
 
 Leds &Leds::instance() {
     static Leds leds;
@@ -509,9 +679,9 @@ void Leds::transfer() {
                 return f;
             };
             v = fix_ws2816(v);
-            auto convert_half_to_spi = [] (uint8_t x) {
-                return 0x88888888 | (((x >>  4) | (x <<  6) | (x << 16) | (x << 26)) & 0x04040404)|
-                                    (((x >>  1) | (x <<  9) | (x << 19) | (x << 29)) & 0x40404040);
+            auto convert_half_to_spi = [] (uint8_t b) {
+                return 0x88888888 | (((b >>  4) | (b <<  6) | (b << 16) | (b << 26)) & 0x04040404)|
+                                    (((b >>  1) | (b <<  9) | (b << 19) | (b << 29)) & 0x40404040);
             };
             *p++ = convert_half_to_spi((v>>8)&0xFF);
             *p++ = convert_half_to_spi((v>>0)&0xFF);
@@ -521,238 +691,3603 @@ void Leds::transfer() {
         constexpr auto limit = fixed32<20>(128.0f);
         constexpr auto limit_1 = fixed32<20>(1.0f/128.0f);
 
-        ptr = convert_to_one_wire_spi(ptr, ((led_buffer[c].g.clamp(fixed32<20>(0.0f), limit)) * limit_1).raw);
-        ptr = convert_to_one_wire_spi(ptr, ((led_buffer[c].r.clamp(fixed32<20>(0.0f), limit)) * limit_1).raw);
-        ptr = convert_to_one_wire_spi(ptr, ((led_buffer[c].b.clamp(fixed32<20>(0.0f), limit)) * limit_1).raw);
+        // At most 2^20 times 2^11, which still fits.
+        auto level = [&, g = uint32_t(gain[c])](fixed32<20> v) {
+            return (uint32_t((v.clamp(fixed32<20>(0.0f), limit) * limit_1).raw) * g) >> 11;
+        };
+        ptr = convert_to_one_wire_spi(ptr, level(led_buffer[c].g));
+        ptr = convert_to_one_wire_spi(ptr, level(led_buffer[c].r));
+        ptr = convert_to_one_wire_spi(ptr, level(led_buffer[c].b));
     }
 
     for (size_t c = 0; c < spiPaddingBytes/(sizeof(uint32_t)*2); c++ ) {
         *ptr++ = 0;
     };
 
-#ifdef USE_HAL_DRIVER
-    HAL_SPI_DMAStop(&hspi1);
-    HAL_SPI_Transmit_DMA(&hspi1, spi_buffer, sizeof(spi_buffer));
-#endif  //#ifdef USE_HAL_DRIVER
+    TRACE(DmaStart, 0);
+
+    drivers::SpiDma::start(spi_buffer, sizeof(spi_buffer));
+#ifndef USE_HAL_DRIVER
+    completed.push(0);
+#endif  // #ifndef USE_HAL_DRIVER
+    started = true;
 }
 
-class Model {
+// Builds a per-LED table at compile time from f(c, column[c]...), so it ends
+// up in flash and costs nothing per frame. Like Leds::each, f only sees the
+// layout columns it names.
+template<typename T, typename F, typename... C> static consteval std::array<T, Leds::ledsN> led_table(F f, const std::array<C, Leds::ledsN> &... columns) {
+    std::array<T, Leds::ledsN> table;
+    Leds::each([&](size_t c, C... v) {
+        table[c] = f(c, v...);
+    }, columns...);
+    return table;
+}
+
+// Per-LED attributes derived from the Leds layout. Only the tables a pattern
+// actually reads are linked in, 48 bytes each.
+class Geometry {
 public:
+    // Position relative to the centre of the bounding box.
+    static constexpr auto cx = led_table<fixed32<20>>([](size_t, fixed32<20> x) {
+        return x - fixed32<20>(0.5f);
+    }, Leds::x);
+    static constexpr auto cy = led_table<fixed32<20>>([](size_t, fixed32<20> y) {
+        return y - fixed32<20>(0.5f);
+    }, Leds::y);
 
-    static Model &instance();
+    // Radius curves: 2r clamped to 0..1, and linear falloffs to the edge.
+    static constexpr auto inner = led_table<fixed32<20>>([](size_t, fixed32<20> r) {
+        return (fixed32<20>(2.00f) * r).clamp(fixed32<20>(0.0f), fixed32<20>(1.0f));
+    }, Leds::radius);
+    static constexpr auto falloff = led_table<fixed32<20>>([](size_t, fixed32<20> r) {
+        return fixed32<20>(1.0f) - fixed32<20>(1.0f) * r;
+    }, Leds::radius);
+    static constexpr auto falloff95 = led_table<fixed32<20>>([](size_t, fixed32<20> r) {
+        return fixed32<20>(1.0f) - fixed32<20>(0.95f) * r;
+    }, Leds::radius);
 
-    size_t Pattern() const { return pattern; }
-    void IncPattern() { pattern++; }
+    // Constants, for kernel parameters that take a table.
+    static constexpr auto full = led_table<fixed32<20>>([](size_t) {
+        return fixed32<20>(1.0f);
+    });
+    static constexpr auto no_offset = led_table<uint32_t>([](size_t) {
+        return uint32_t(0);
+    });
+};
 
-    void load();
-    void save();
+// LED neighbour graph from layout.h in CSR form, so spreading light between
+// neighbours costs O(edges) per frame.
+class Graph {
+public:
+    template<typename F> static constexpr void neighbours(size_t c, F f) {
+        for (size_t e = layout::offsets[c]; e < layout::offsets[c + 1]; e++) {
+            f(size_t(layout::neighbours[e]));
+        }
+    }
 
-    class pseudo_random {
-    public:
-        
-        void set_seed(uint32_t seed) {
-            uint32_t i;
-            a = 0xf1ea5eed, b = c = d = seed;
-            for (i=0; i<20; ++i) {
-                (void)get();
+    static constexpr auto inv_degree = led_table<fixed32<20>>([](size_t c) {
+        return fixed32<20>(1) / fixed32<20>(int32_t(layout::offsets[c + 1] - layout::offsets[c]));
+    });
+
+    // Moves every LED towards its neighbour average by rate. Runs in place,
+    // so later LEDs see already blurred neighbours. That saves a frame buffer
+    // on the stack and is not visible at these rates.
+    static void diffuse(rgb *buffer, fixed32<20> rate) {
+        for (size_t c = 0; c < Leds::ledsN; c++) {
+            rgb sum;
+            neighbours(c, [&](size_t n) {
+                sum += buffer[n];
+            });
+            buffer[c] += (sum * inv_degree[c] - buffer[c]) * rate;
+        }
+    }
+};
+
+// Spatial index for sweeps. For each of anglesN directions the LEDs are kept
+// sorted by their projection onto it, so a straight band across the layout
+// is one run found by binary search instead of a test per LED. Projections
+// are floored to Q14. For a direction between the indexed ones visit()
+// widens the band by how far any projection can move, which it bounds from
+// the actual cos/sin in use, so no LED inside the band is ever missed.
+template<size_t N, size_t anglesN> class BandIndex {
+public:
+    static_assert(64 % anglesN == 0, "directions are taken from sin_cos_table");
+
+    using Index = std::conditional_t<(N <= 256), uint8_t, uint16_t>;
+
+    static constexpr fixed32<20> cos_of(size_t k) { return sin_cos_table<20>[(k * (64 / anglesN) + 16) % 64]; }
+    static constexpr fixed32<20> sin_of(size_t k) { return sin_cos_table<20>[(k * (64 / anglesN)) % 64]; }
+
+    // Indexed direction nearest to turn / 256 of a full circle.
+    static constexpr size_t nearest(int32_t turn) {
+        return ((uint32_t(turn & 255) * anglesN + 128) >> 8) % anglesN;
+    }
+
+    static constexpr BandIndex build(const std::array<fixed32<20>, N> &x, const std::array<fixed32<20>, N> &y) {
+        BandIndex index;
+        for (size_t c = 0; c < N; c++) {
+            index.reach_x = std::max(index.reach_x, x[c].abs());
+            index.reach_y = std::max(index.reach_y, y[c].abs());
+        }
+        for (size_t k = 0; k < anglesN; k++) {
+            std::array<std::pair<int16_t, Index>, N> sorted;
+            for (size_t c = 0; c < N; c++) {
+                sorted[c] = { int16_t(q14(x[c] * cos_of(k) - y[c] * sin_of(k))), Index(c) };
+            }
+            std::sort(sorted.begin(), sorted.end());
+            for (size_t c = 0; c < N; c++) {
+                index.proj[k][c] = sorted[c].first;
+                index.order[k][c] = sorted[c].second;
             }
         }
+        return index;
+    }
 
-        #define rot(x,k) (((x)<<(k))|((x)>>(32-(k))))
-        uint32_t get() {
-            uint32_t e = a - rot(b, 27);
-            a = b ^ rot(c, 17);
-            b = c + d;
-            c = d + e;
-            d = e + a;
-            return d;
+    // Calls f(c) for every LED whose projection x * ca - y * sa may lie in
+    // [lo, hi], k being the indexed direction nearest to (ca, sa).
+    template<typename F> constexpr void visit(size_t k, fixed32<20> ca, fixed32<20> sa, fixed32<20> lo, fixed32<20> hi, F f) const {
+        auto margin = (ca - cos_of(k)).abs() * reach_x + (sa - sin_of(k)).abs() * reach_y + fixed32<20>(1.0f / 4096.0f);
+        int32_t first = q14(lo - margin);
+        int32_t last = q14(hi + margin);
+        auto &p = proj[k];
+        for (size_t i = size_t(std::lower_bound(p.begin(), p.end(), first) - p.begin()); i < N && p[i] <= last; i++) {
+            f(size_t(order[k][i]));
         }
+    }
 
-        uint32_t get(uint32_t lower, uint32_t upper) {
-            return (static_cast<int32_t>(get()) % (upper-lower)) + lower;
+    std::array<std::array<int16_t, N>, anglesN> proj {};
+    std::array<std::array<Index, N>, anglesN> order {};
+    fixed32<20> reach_x;
+    fixed32<20> reach_y;
+
+private:
+    static constexpr int32_t q14(fixed32<20> v) { return v.raw >> 6; }
+};
+
+// LEDs sorted by distance from the centre, so a ring is one run.
+template<size_t N> class RingIndex {
+public:
+    using Index = std::conditional_t<(N <= 256), uint8_t, uint16_t>;
+
+    static constexpr RingIndex build(const std::array<fixed32<20>, N> &radius) {
+        RingIndex index;
+        std::array<std::pair<int16_t, Index>, N> sorted;
+        for (size_t c = 0; c < N; c++) {
+            sorted[c] = { int16_t(q14(radius[c])), Index(c) };
+        }
+        std::sort(sorted.begin(), sorted.end());
+        for (size_t c = 0; c < N; c++) {
+            index.dist[c] = sorted[c].first;
+            index.order[c] = sorted[c].second;
         }
+        return index;
+    }
 
-    private:
-        uint32_t a; 
-        uint32_t b; 
-        uint32_t c; 
-        uint32_t d; 
+    // Calls f(c) for every LED whose radius may lie in [lo, hi].
+    template<typename F> constexpr void visit(fixed32<20> lo, fixed32<20> hi, F f) const {
+        int32_t first = q14(lo - fixed32<20>(1.0f / 4096.0f));
+        int32_t last = q14(hi + fixed32<20>(1.0f / 4096.0f));
+        for (size_t i = size_t(std::lower_bound(dist.begin(), dist.end(), first) - dist.begin()); i < N && dist[i] <= last; i++) {
+            f(size_t(order[i]));
+        }
+    }
 
-    } rnd;
-    
-    bool button_down = false;
+    std::array<int16_t, N> dist {};
+    std::array<Index, N> order {};
 
 private:
-    size_t pattern;
+    static constexpr int32_t q14(fixed32<20> v) { return v.raw >> 6; }
+};
 
-    void init();
-    bool initialized = false;
+// LEDs grouped by equal radius. Patterns that only depend on the radius
+// shade the first LED of each class and copy it to the rest, so they cost
+// one shade() per distinct radius instead of one per LED.
+template<size_t N, size_t classesN> class RadiusClasses {
+public:
+    using Index = std::conditional_t<(N <= 256), uint8_t, uint16_t>;
+
+    // Same grouping as convert_points, the first LED with a radius leads.
+    static constexpr RadiusClasses build(const std::array<fixed32<20>, N> &radius) {
+        RadiusClasses classes;
+        size_t count = 0;
+        for (size_t c = 0; c < N; c++) {
+            size_t k = 0;
+            while (k < count && radius[classes.lead[k]].raw != radius[c].raw) {
+                k++;
+            }
+            if (k == count) {
+                classes.lead[count++] = Index(c);
+            }
+            classes.of[c] = Index(k);
+        }
+        return classes;
+    }
+
+    // With a class per LED this is the plain loop, without the lead lookups.
+    template<typename F> constexpr void scatter(rgb *out, F f) const {
+        if constexpr (classesN == N) {
+            for (size_t c = 0; c < N; c++) {
+                out[c] = f(c);
+            }
+            return;
+        }
+        for (size_t k = 0; k < classesN; k++) {
+            out[lead[k]] = f(size_t(lead[k]));
+        }
+        if constexpr (classesN < N) {
+            for (size_t c = 0; c < N; c++) {
+                out[c] = out[lead[of[c]]];
+            }
+        }
+    }
+
+    constexpr bool operator==(const RadiusClasses &) const = default;
+
+    std::array<Index, N> of {};
+    std::array<Index, classesN> lead {};
 };
 
-Model &Model::instance() {
-    static Model model;
-    if (!model.initialized) {
-        model.initialized = true;
-        model.init();
+// The radius classes of this board, from layout.h.
+class Radial {
+public:
+    using Classes = RadiusClasses<Leds::ledsN, layout::radiusClassesN>;
+
+    static constexpr Classes classes = [] {
+        Classes table;
+        std::copy(std::begin(layout::radius_class), std::end(layout::radius_class), table.of.begin());
+        std::copy(std::begin(layout::radius_lead), std::end(layout::radius_lead), table.lead.begin());
+        return table;
+    }();
+
+    template<typename F> static void shade(rgb *out, F f) {
+        if (bypass) {
+            for (size_t c = 0; c < Leds::ledsN; c++) {
+                out[c] = f(c);
+            }
+        } else {
+            classes.scatter(out, f);
+        }
     }
-    return model;
-}
 
-void Model::load() {
+#ifndef USE_HAL_DRIVER
+    // Shade every LED, for comparing against the per-class output.
+    static bool bypass;
+#else  // #ifndef USE_HAL_DRIVER
+    static constexpr bool bypass = false;
+#endif  // #ifndef USE_HAL_DRIVER
+};
+
+static_assert(Radial::classes == Radial::Classes::build(Leds::radius), "layout.h radius classes do not match Leds::radius");
+
+#ifndef USE_HAL_DRIVER
+bool Radial::bypass = false;
+#endif  // #ifndef USE_HAL_DRIVER
+
+// Monotonic animation clock in real time. advance() runs once per frame and
+// measures the elapsed milliseconds, so animation speed does not depend on
+// the SysTick frequency or on skipped frames. On the host the clock either
+// follows the wall clock scaled by speed, or advances by a fixed step per
+// frame for reproducible runs.
+class Time {
+public:
+    static Time &instance();
+
+    void advance() {
+        uint32_t source = source_ms();
+        uint32_t scaled = (started ? source - last_source_ms : 0) * rate + rate_carry;
+        frame_ms = scaled >> 4;
+        rate_carry = scaled & 15;
+        last_source_ms = source;
+        started = true;
+        now_ms += frame_ms;
+    }
+
+    // Animation speed in 1/16ths of real time.
+    void set_rate(uint8_t sixteenths) { rate = sixteenths; }
+
+    // Wraps after 49 days, only use differences.
+    uint32_t ms() const { return now_ms; }
+
+    // Real time, not scaled by the rate.
+    uint32_t real_ms() const { return last_source_ms; }
+
+    // Real time for interrupts. On the target it steps by 1ms between HAL's
+    // 10ms ticks, on the host it is the frame's real_ms().
+    static uint32_t irq_ms() {
 #ifdef USE_HAL_DRIVER
-    pattern = *((uint32_t *)DATA_EEPROM_BASE);
+        return drivers::SysTickClock::ms(uwTick, uint32_t(uwTickFreq));
+#else  // #ifdef USE_HAL_DRIVER
+        return instance().real_ms();
 #endif  // #ifdef USE_HAL_DRIVER
-}
+    }
+    uint32_t delta_ms() const { return frame_ms; }
+
+    fixed32<16> delta() const { return seconds(frame_ms); }
+
+    // Only for spans below 9 hours, fixed32<16> overflows beyond that.
+    static fixed32<16> seconds(uint32_t ms) {
+        fixed32<16> s;
+        s.raw = int32_t((uint64_t(ms) * 4294967) >> 16);
+        return s;
+    }
+
+#ifndef USE_HAL_DRIVER
+    static uint32_t step_ms;
+    static uint32_t speed;
+#endif  // #ifndef USE_HAL_DRIVER
 
-void Model::save() {
+private:
+    uint32_t source_ms() {
 #ifdef USE_HAL_DRIVER
-    HAL_FLASHEx_DATAEEPROM_Unlock();
-    HAL_FLASHEx_DATAEEPROM_Erase(DATA_EEPROM_BASE);
-    HAL_FLASHEx_DATAEEPROM_Program(FLASH_TYPEPROGRAMDATA_WORD, DATA_EEPROM_BASE, pattern);
-    HAL_FLASHEx_DATAEEPROM_Lock();
+        return HAL_GetTick();
+#else  // #ifdef USE_HAL_DRIVER
+        if (step_ms) {
+            return last_source_ms + step_ms;
+        }
+        return speed * static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count());
 #endif  // #ifdef USE_HAL_DRIVER
-}
+    }
 
-void Model::init() {
-    load();
-    rnd.set_seed(0xDEADBEEF);
+    uint32_t now_ms = 0;
+    uint32_t frame_ms = 0;
+    uint32_t last_source_ms = 0;
+    uint32_t rate = 16;
+    uint32_t rate_carry = 0;
+    bool started = false;
+};
+
+#ifndef USE_HAL_DRIVER
+uint32_t Time::step_ms = 0;
+uint32_t Time::speed = 1;
+#endif  // #ifndef USE_HAL_DRIVER
+
+Time &Time::instance() {
+    static Time time;
+    return time;
 }
 
-extern "C" void HAL_GPIO_EXTI_Callback(uint16_t pin) {
-#ifdef USE_HAL_DRIVER
-    if (pin == GPIO_PIN_1) {
-        Model::instance().button_down = true;
+// DDS-style phase accumulator. A full cycle is 2^32 so the phase wraps for
+// free and keeps 32 bits of precision no matter how long the badge runs.
+// advance() adds the per-frame increment, which is only recomputed when the
+// frame period changes. at() extrapolates to a nearby time (interpolator
+// keyframes) without touching the accumulator.
+class Phase {
+public:
+    constexpr Phase() = default;
+
+    // Negative rates run the phase backwards.
+    consteval explicit Phase(float hz) :
+        rate(uint32_t(int64_t(hz * 4294967.296f + (hz < 0 ? -0.5f : 0.5f)))) {
     }
-#endif  // #ifdef USE_HAL_DRIVER
-}
 
-extern "C" void HAL_SysTick_User(void) {
+    void advance(uint32_t now_ms) {
+        uint32_t delta = now_ms - last_ms;
+        if (delta != step_ms) {
+            step_ms = delta;
+            step = rate * delta;
+        }
+        value += step;
+        last_ms = now_ms;
+    }
 
-#ifdef USE_HAL_DRIVER
-    if (Model::instance().button_down && 
-        HAL_GPIO_ReadPin(GPIOB, GPIO_PIN_1) == GPIO_PIN_SET) {
-        Model::instance().IncPattern();
-        Model::instance().save();
-        Model::instance().button_down = false;
+    uint32_t raw(uint32_t ms) const {
+        return value + rate * (ms - last_ms);
     }
-#endif  // #ifdef USE_HAL_DRIVER
 
-    static fixed32<16> tick;
+    fixed32<20> at(uint32_t ms) const {
+        fixed32<20> f;
+        f.raw = int32_t(raw(ms) >> 12);
+        return f;
+    }
 
-    switch(Model::instance().Pattern() % 9) {
-        case    0: {
-                    for (size_t c = 0; c < Leds::ledsN; c++) {
-                        auto i = (fixed32<20>(2.00f) * fixed32<20>(std::get<2>(Leds::map[c]))).clamp(fixed32<20>(0.0f), fixed32<20>(1.0f));
-                        auto col0 = rgb(0xBB9900);
-                        auto col1 = rgb(0xAA5500);
-                        Leds::led_buffer[c] = lerp(col0, col1, i);
-                    }
+    // Continues from a phase saved with raw() in an earlier run.
+    void resume(uint32_t saved, uint32_t now_ms) {
+        value = saved;
+        last_ms = now_ms;
+        step_ms = 0;
+        step = 0;
+    }
 
-                    static auto prev_tick = fixed32<16>(0.0f);
-                    static auto next_tick = fixed32<16>(0.0f);
-                    static auto cur_angle = fixed32<20>(0.0f);
-                    if ( next_tick <= tick ) {
-                        prev_tick = next_tick;
-                        next_tick = tick + fixed32<16>(Model::instance().rnd.get(6,24));
-                        cur_angle = fixed32<20>(6.283185307179f/256.0f)*fixed32<20>(Model::instance().rnd.get(0,256));
-                    }
+private:
+    uint32_t rate = 0;
+    uint32_t value = 0;
+    uint32_t last_ms = 0;
+    uint32_t step_ms = 0;
+    uint32_t step = 0;
+};
+
+// Oscillator bank entry: a Phase plus a waveform. Patterns take one Frame per
+// render with at() and sample it per LED with a phase offset, so the time
+// math stays out of the per-LED loops. Outputs are 0..1 except Sine, which is
+// -1..1 and uses the top 6 phase bits as table index and the next bits as
+// the lerp weight.
+class Oscillator {
+public:
+    enum Wave : uint8_t {
+        Sine,
+        Triangle,
+        Saw,
+        Square,
+        Noise
+    };
 
-                    auto now_time = tick - prev_tick;
+    constexpr Oscillator() = default;
 
-                    for (size_t c = 0; c < Leds::ledsN; c++) {
-                        fixed32<20> x = fixed32<20>(now_time) * fixed32<20>(6.0f) +
-                            ((std::get<0>(Leds::map[c]) - fixed32<20>(0.5f)) * cos(cur_angle) - 
-                             (std::get<1>(Leds::map[c]) - fixed32<20>(0.5f)) * sin(cur_angle));
-                        if (x.abs() < fixed32<20>(1.0f)) {
-                            auto b = ((x.abs().reflect() - fixed32<20>(0.5f)) * fixed32<20>(4.0f)).clamp(fixed32<20>(0.0f), fixed32<20>(1.0f));
-                            Leds::led_buffer[c] += rgb(hsv(fixed32<20>(0.0f), fixed32<20>(0.0f), b)) * fixed32<20>(4.0f);
-                        }
-                    }
-                } break;
-        case    1: {
-                    for (size_t c = 0; c < Leds::ledsN; c++) {
-                        fixed32<20> h = fixed32<20>(1.0f) - (fixed32<20>(tick) * fixed32<20>(0.02f)).frac();
-                        Leds::led_buffer[c] = rgb(hsv(h, (fixed32<20>(2.00f) * fixed32<20>(std::get<2>(Leds::map[c]))).clamp(fixed32<20>(0.0f), fixed32<20>(1.0f)), fixed32<20>(1.0f) - fixed32<20>(1.0f) * fixed32<20>(std::get<2>(Leds::map[c]))));
-                    }
-                } break;
-        case    2: {
-                    for (size_t c = 0; c < Leds::ledsN; c++) {
-                        auto t = fixed32<20>(1.0f) - fixed32<20>(tick * fixed32<16>(0.08f)).frac();
-                        auto h = t * fixed32<20>(6.28318530718f);
-                        auto x = (std::get<0>(Leds::map[c]) - fixed32<20>(0.5f)) * cos(h) - 
-                                 (std::get<1>(Leds::map[c]) - fixed32<20>(0.5f)) * sin(h);
-                        auto hue((x * fixed32<20>(0.5f) + fixed32<20>(0.5f) + t * fixed32<20>(6.0f)).frac());
-                        Leds::led_buffer[c] = rgb(hsv(hue, fixed32<20>(1.0f), fixed32<20>(1.0f) - fixed32<20>(0.95f) * fixed32<20>(std::get<2>(Leds::map[c]))));
-                    }
-                } break;
-        case    3: {
-                    for (size_t c = 0; c < Leds::ledsN; c++) {
-                        auto h = (fixed32<20>(1.0f) - fixed32<20>(tick * fixed32<16>(0.02f)).frac());
-                        auto hue((h + fixed32<20>(std::get<0>(Leds::map[c])) * fixed32<20>(std::get<1>(Leds::map[c])) * fixed32<20>(1.0f / 2.0f)).frac());
-                        Leds::led_buffer[c] = rgb(hsv(hue, fixed32<20>(1.0f), fixed32<20>(1.0f) - fixed32<20>(0.95f) * fixed32<20>(std::get<2>(Leds::map[c]))));
-                    }
-                } break;
-        case    4: {
-                    for (size_t c = 0; c < Leds::ledsN; c++) {
-                        auto h = (fixed32<20>(1.0f) - fixed32<20>(tick * fixed32<16>(0.01f)).frac());
-                        auto hue((h - fixed32<20>(std::get<0>(Leds::map[c])) * fixed32<20>(1.0f / 8.0f)).frac());
-                        Leds::led_buffer[c] = rgb(hsv(hue, fixed32<20>(1.0f), fixed32<20>(1.0f) - fixed32<20>(0.95f) * fixed32<20>(std::get<2>(Leds::map[c]))));
-                    }
-                } break;
-        case    5: {
-                    for (size_t c = 0; c < Leds::ledsN; c++) {
-                        Leds::led_buffer[c] = rgb(fixed32<20>(0.0f), fixed32<20>(0.0f), fixed32<20>(0.0f));
-                    }
-					for (size_t c = 0; c < 2; c++) {
-						int32_t i = Model::instance().rnd.get(0,Leds::ledsN);
-						auto v = fixed32<20>(1.0f/127.0f)*fixed32<20>(Model::instance().rnd.get(0,127));
-						Leds::led_buffer[i] = rgb(v, v, v);
-					}
-                } break;
-        case    6: {
-                    for (size_t c = 0; c < Leds::ledsN; c++) {
-                        Leds::led_buffer[c] = rgb(fixed32<20>(0.0f), fixed32<20>(0.0f), fixed32<20>(0.0f));
-                    }
-					for (size_t c = 0; c < 2; c++) {
-						int32_t i =  Model::instance().rnd.get(0,Leds::ledsN);
-						Leds::led_buffer[i] = rgb(
-							fixed32<20>(1.0f/127.0f)*fixed32<20>(Model::instance().rnd.get(0,127)), 
-							fixed32<20>(1.0f/127.0f)*fixed32<20>(Model::instance().rnd.get(0,127)), 
-							fixed32<20>(1.0f/127.0f)*fixed32<20>(Model::instance().rnd.get(0,127)));
-					}
-                } break;
-        case    7: {
-                    for (size_t c = 0; c < Leds::ledsN; c++) {
-                        auto i = (fixed32<20>(2.00f) * fixed32<20>(std::get<2>(Leds::map[c]))).clamp(fixed32<20>(0.0f), fixed32<20>(1.0f));
-                        auto col0 = rgb(0xFF1111);
-                        auto col1 = rgb(0x1111FF);
-                        Leds::led_buffer[c] = lerp(col0, col1, i);
-                    }
-                } break;
-        case    8: {
-                    for (size_t c = 0; c < Leds::ledsN; c++) {
-                        Leds::led_buffer[c] = rgb(hsv(fixed32<20>(0.1f), fixed32<20>(1.00f) + fixed32<20>(1.50f) * fixed32<20>(std::get<2>(Leds::map[c])), fixed32<20>(1.0f) - fixed32<20>(0.9f) * fixed32<20>(std::get<2>(Leds::map[c]))));
-                    }
-                } break;
+    consteval Oscillator(float hz, Wave _wave) :
+        phase(hz),
+        wave(_wave) {
     }
-    tick += fixed32<16>(1.0f/(100.0f));
-#ifndef USE_HAL_DRIVER
-    printf("\033[0H"); fflush(stdout);    
-    for (size_t c = 0; c < Leds::ledsN; c++) {
-        printf("\033[%d;%dH\033[48;2;%d;%d;%dm  \033[48;2;0;0;0m",
-            16-static_cast<int32_t>(std::get<1>(Leds::map[c]) * fixed32<20>(16)),
-               static_cast<int32_t>(std::get<0>(Leds::map[c]) * fixed32<20>(32)),
-            int32_t(std::clamp(float(Leds::led_buffer[c].r), 0.0f, 1.0f)*255.0f),
-            int32_t(std::clamp(float(Leds::led_buffer[c].g), 0.0f, 1.0f)*255.0f),
-            int32_t(std::clamp(float(Leds::led_buffer[c].b), 0.0f, 1.0f)*255.0f));
+
+    void advance(uint32_t now_ms) { phase.advance(now_ms); }
+
+    class Frame {
+    public:
+        fixed32<20> operator()(uint32_t offset = 0) const {
+            return shape(wave, base + offset);
+        }
+
+        uint32_t base;
+        Wave wave;
+    };
+
+    Frame at(uint32_t ms) const { return Frame { phase.raw(ms), wave }; }
+
+    uint32_t snapshot(uint32_t ms) const { return phase.raw(ms); }
+    void resume(uint32_t saved, uint32_t now_ms) { phase.resume(saved, now_ms); }
+
+    // Phase offset of a fraction of a cycle.
+    static constexpr uint32_t offset(fixed32<20> cycles) {
+        return uint32_t(cycles.raw) << 12;
     }
-#endif  // #ifndef USE_HAL_DRIVER
 
-    Leds::instance().transfer();
-}
+    static constexpr fixed32<20> shape(Wave wave, uint32_t p) {
+        fixed32<20> v;
+        switch (wave) {
+            case Sine: {
+                fixed32<20> i0 = sin_cos_table<20>[(p >> 26)];
+                fixed32<20> i1 = sin_cos_table<20>[((p >> 26) + 1) & 63];
+                v.raw = int32_t((p >> 6) & 0xFFFFF);
+                return lerp(i0, i1, v);
+            }
+            case Triangle:
+                v.raw = int32_t(((p & 0x80000000) ? ~p : p) >> 11);
+                return v;
+            case Saw:
+                v.raw = int32_t(p >> 12);
+                return v;
+            case Square:
+                v.raw = (p & 0x80000000) ? 0 : (1 << 20);
+                return v;
+            case Noise: {
+                // Sample and hold, 64 steps per cycle.
+                uint32_t h = (p >> 26) * 0x9E3779B1;
+                h ^= h >> 15;
+                h *= 0x85EBCA77;
+                h ^= h >> 13;
+                v.raw = int32_t(h >> 12);
+                return v;
+            }
+        }
+        return v;
+    }
 
-#ifndef USE_HAL_DRIVER
-int main() {
+private:
+    Phase phase;
+    Wave wave = Saw;
+};
+
+// Linear interpolation between two keyframes. A pattern that opts in is
+// rendered only once per interval, one interval ahead of time, and the frames
+// in between are blended from the stored keys by elapsed time. After a gap of
+// more than one interval both keys are rendered again. Keys are kept in the 16-bit
+// format Leds::transfer() sends (13 fraction bits) to save RAM.
+class Interpolator {
+public:
+    static Interpolator &instance();
+
+    // True when a keyframe is due at now_ms. If primed() is false afterwards
+    // the first key has to be rendered at key_ms() too.
+    bool begin(uint32_t now_ms, uint32_t interval_ms) {
+        if (keys < 2 || interval_ms != length || now_ms - start_ms >= 2 * interval_ms) {
+            keys = 0;
+            start_ms = now_ms;
+            length = interval_ms;
+            weight_scale = (256 << 16) / interval_ms;
+            return true;
+        }
+        if (now_ms - start_ms >= interval_ms) {
+            start_ms += interval_ms;
+            return true;
+        }
+        return false;
+    }
+
+    bool primed() const { return keys != 0; }
+
+    uint32_t key_ms() const { return start_ms; }
+    uint32_t next_ms() const { return start_ms + length; }
+
+    void push(const rgb *frame) {
+        for (size_t c = 0; c < Leds::ledsN; c++) {
+            auto encode = [](fixed32<20> v) {
+                return uint16_t(v.clamp(fixed32<20>(0.0f), fixed32<20>(7.99f)).raw >> 7);
+            };
+            key[0][c][0] = key[1][c][0];
+            key[0][c][1] = key[1][c][1];
+            key[0][c][2] = key[1][c][2];
+            key[1][c][0] = encode(frame[c].r);
+            key[1][c][1] = encode(frame[c].g);
+            key[1][c][2] = encode(frame[c].b);
+        }
+        keys = keys < 2 ? keys + 1 : 2;
+    }
+
+    void blend(rgb *out, uint32_t now_ms) const {
+        int32_t w = int32_t(std::min(((now_ms - start_ms) * weight_scale) >> 16, uint32_t(256)));
+        for (size_t c = 0; c < Leds::ledsN; c++) {
+            auto decode = [w](int32_t a, int32_t b) {
+                fixed32<20> v;
+                v.raw = (a + (((b - a) * w) >> 8)) << 7;
+                return v;
+            };
+            out[c] = rgb(decode(key[0][c][0], key[1][c][0]),
+                         decode(key[0][c][1], key[1][c][1]),
+                         decode(key[0][c][2], key[1][c][2]));
+        }
+    }
+
+    void invalidate() { keys = 0; }
+
+#ifndef USE_HAL_DRIVER
+    // Render every frame, static patterns too, for comparing against the
+    // full-rate output.
+    static bool bypass;
+#else  // #ifndef USE_HAL_DRIVER
+    static constexpr bool bypass = false;
+#endif  // #ifndef USE_HAL_DRIVER
+
+private:
+    uint16_t key[2][Leds::ledsN][3];
+    uint32_t keys = 0;
+    uint32_t start_ms = 0;
+    uint32_t length = 0;
+    uint32_t weight_scale = 0;
+};
+
+#ifndef USE_HAL_DRIVER
+bool Interpolator::bypass = false;
+#endif  // #ifndef USE_HAL_DRIVER
+
+Interpolator &Interpolator::instance() {
+    static Interpolator interpolator;
+    return interpolator;
+}
+
+// A look runs on its Kernel, any other pattern is its own kernel.
+template<typename P> struct KernelOf {
+    using type = P;
+};
+
+template<typename P> requires requires { typename P::Kernel; } struct KernelOf<P> {
+    using type = typename P::Kernel;
+};
+
+template<typename P> using kernel_of = typename KernelOf<P>::type;
+
+// Params record of the running look and whether it is radial, set by
+// Arena::enter().
+class Look {
+public:
+    template<typename K> static const typename K::Params &params() {
+        return *static_cast<const typename K::Params *>(current);
+    }
+
+    static const void *current;
+    static bool radial;
+};
+
+const void *Look::current = nullptr;
+bool Look::radial = false;
+
+template<typename P> static constexpr size_t state_size() {
+    if constexpr (requires { typename P::State; }) {
+        return sizeof(typename P::State);
+    } else {
+        return 0;
+    }
+}
+
+// Compile-time pattern registry. The pattern classes are defined further
+// down and info[] is filled from them there, so adding a pattern is one line
+// in Patterns. Each entry is the dispatch target plus what the engine needs
+// to know to run it, taken from the pattern's kernel.
+template<typename... P> class Registry {
+public:
+    static constexpr size_t count = sizeof...(P);
+
+    struct Info {
+        void (*draw)(uint32_t ms);
+        void (*enter)();                    // constructs State in Arena, may be null
+        void (*exit)();                     // destroys State, may be null
+        void (*advance)(uint32_t now_ms);   // steps State::osc, may be null
+        Oscillator *(*osc)();               // State::osc, may be null
+        const void *params;                 // a look's Kernel::Params, may be null
+        uint16_t keyframe_ms;   // 0 renders every frame
+        uint8_t uniforms;       // bytes of per-frame uniforms
+        uint8_t state;          // bytes of State in Arena
+        bool animated;          // false renders once on entry
+        bool radial;            // shaded once per radius class
+    };
+
+    static const Info info[count];
+
+    // Position of pattern T in the pack, count if the pack leaves it out.
+    template<typename T> static constexpr size_t index_of() {
+        size_t index = 0;
+        ((std::is_same_v<T, P> ? false : (index++, true)) && ...);
+        return index;
+    }
+
+    // Size of the largest State, which is all the pattern RAM there is.
+    static constexpr size_t state_max() {
+        return std::max({ size_t(1), state_size<kernel_of<P>>()... });
+    }
+
+    // Whether some or all of the patterns running on kernel K are radial.
+    template<typename K> static constexpr bool radial_any() {
+        return ((std::is_same_v<kernel_of<P>, K> && requires { P::radial; }) || ...);
+    }
+
+    template<typename K> static constexpr bool radial_all() {
+        return ((!std::is_same_v<kernel_of<P>, K> || requires { P::radial; }) && ...);
+    }
+};
+
+// The build picks which patterns go in, see cmake/packs.cmake. Without a
+// generated pack.h, as on the host, every pattern is in.
+#if __has_include("pack.h")
+#include "pack.h"
+#else  // #if __has_include("pack.h")
+#define CAPN_PACK "all"
+#define CAPN_PACK_PATTERNS \
+    class Sweep, \
+    class HueCycle, \
+    class Spin, \
+    class Diagonal, \
+    class Scroll, \
+    class Sparkle, \
+    class Confetti, \
+    class Gradient, \
+    class Glow, \
+    class Ripple
+#endif  // #if __has_include("pack.h")
+
+using Patterns = Registry<CAPN_PACK_PATTERNS>;
+
+// The data EEPROM, word addressed. Erased words read as 0 and a word can be
+// programmed without erasing it first. Programming a word takes about 3.2ms
+// and, with a single flash bank, stalls every flash read until it is done,
+// interrupts included. On the host it is an array that also counts reads
+// and writes per word and models that busy time on a microsecond clock.
+class Eeprom {
+public:
+    static constexpr size_t wordsN = 128;
+    static constexpr uint32_t programUs = 3200;
+
+    static uint32_t read(size_t word) {
+#ifdef USE_HAL_DRIVER
+        return drivers::DataEeprom::read(word);
+#else  // #ifdef USE_HAL_DRIVER
+        reads++;
+        return data[word];
+#endif  // #ifdef USE_HAL_DRIVER
+    }
+
+    // Only between unlock() and lock(). Waits for the word to be programmed,
+    // false if it failed.
+    static bool write(size_t word, uint32_t value) {
+#ifdef USE_HAL_DRIVER
+        return drivers::DataEeprom::program(word, value);
+#else  // #ifdef USE_HAL_DRIVER
+        stall();
+        start(word, value);
+        stall();
+        return succeeded();
+#endif  // #ifdef USE_HAL_DRIVER
+    }
+
+    // Only between unlock() and lock(), and only when not busy(). Returns
+    // while the word is still being programmed.
+    static void start(size_t word, uint32_t value) {
+#ifdef USE_HAL_DRIVER
+        drivers::DataEeprom::start(word, value);
+#else  // #ifdef USE_HAL_DRIVER
+        busy_until_us = clock_us + programUs;
+        if (write_budget == 0) {
+            return;
+        }
+        write_budget--;
+        if (rejects != 0) {
+            rejects--;
+            rejected = true;
+            return;
+        }
+        wear[word]++;
+        data[word] = value;
+#endif  // #ifdef USE_HAL_DRIVER
+    }
+
+    // Once not busy() after start(). False if the word failed to program.
+    static bool succeeded() {
+#ifdef USE_HAL_DRIVER
+        return drivers::DataEeprom::succeeded();
+#else  // #ifdef USE_HAL_DRIVER
+        bool ok = !rejected;
+        rejected = false;
+        return ok;
+#endif  // #ifdef USE_HAL_DRIVER
+    }
+
+    static bool busy() {
+#ifdef USE_HAL_DRIVER
+        return drivers::DataEeprom::busy();
+#else  // #ifdef USE_HAL_DRIVER
+        return int32_t(busy_until_us - clock_us) > 0;
+#endif  // #ifdef USE_HAL_DRIVER
+    }
+
+    static void unlock() {
+#ifdef USE_HAL_DRIVER
+        drivers::DataEeprom::unlock();
+#endif  // #ifdef USE_HAL_DRIVER
+    }
+
+    static void lock() {
+#ifdef USE_HAL_DRIVER
+        drivers::DataEeprom::lock();
+#endif  // #ifdef USE_HAL_DRIVER
+    }
+
+#ifndef USE_HAL_DRIVER
+    // Waits out programming in progress, the time spent adds to stall_us.
+    static void stall() {
+        if (busy()) {
+            stall_us += busy_until_us - clock_us;
+            clock_us = busy_until_us;
+        }
+    }
+
+    static uint32_t data[wordsN];
+    static uint32_t wear[wordsN];
+    static uint32_t reads;
+    // Writes left before simulated power loss.
+    static uint32_t write_budget;
+    // Writes the controller will flag as failed, leaving the word unchanged.
+    static uint32_t rejects;
+    static bool rejected;
+    static uint32_t clock_us;
+    static uint32_t busy_until_us;
+    static uint32_t stall_us;
+#endif  // #ifndef USE_HAL_DRIVER
+};
+
+#ifndef USE_HAL_DRIVER
+uint32_t Eeprom::data[Eeprom::wordsN] = { };
+uint32_t Eeprom::wear[Eeprom::wordsN] = { };
+uint32_t Eeprom::reads = 0;
+uint32_t Eeprom::write_budget = ~uint32_t(0);
+uint32_t Eeprom::rejects = 0;
+bool Eeprom::rejected = false;
+uint32_t Eeprom::clock_us = 0;
+uint32_t Eeprom::busy_until_us = 0;
+uint32_t Eeprom::stall_us = 0;
+#endif  // #ifndef USE_HAL_DRIVER
+
+// Append-only log of fixed size records across the whole data EEPROM, so
+// every save lands on the next slot instead of wearing out one word. A record
+// is payloadN words followed by a header word holding a sequence number and
+// a CRC of both. The header goes last, so a save cut short by power loss
+// leaves a record that fails the CRC and load() returns the one before it.
+// The log wraps around and overwrites the oldest record. Only the newest
+// record is ever live, so that is all the compaction it needs.
+template<size_t payloadN> class EepromLog {
+public:
+    static constexpr size_t recordN = payloadN + 1;
+    static constexpr size_t slotsN = Eeprom::wordsN / recordN;
+
+    // Newest valid record, false if there is none.
+    static bool load(uint32_t (&payload)[payloadN]) {
+        size_t slot = newest();
+        if (slot == slotsN) {
+            return false;
+        }
+        for (size_t c = 0; c < payloadN; c++) {
+            payload[c] = Eeprom::read(slot * recordN + c);
+        }
+        return true;
+    }
+
+    // The words of the next record and where they go, in write order.
+    struct Record {
+        size_t base;
+        uint32_t words[recordN];
+    };
+
+    static Record prepare(const uint32_t (&payload)[payloadN]) {
+        size_t slot = newest();
+        uint16_t seq = 1;
+        if (slot != slotsN) {
+            seq = next_seq(sequence(Eeprom::read(slot * recordN + payloadN)));
+            slot = (slot + 1) % slotsN;
+        } else {
+            slot = 0;
+        }
+        Record record;
+        record.base = slot * recordN;
+        for (size_t c = 0; c < payloadN; c++) {
+            record.words[c] = payload[c];
+        }
+        record.words[payloadN] = uint32_t(seq) << 16 | crc(payload, seq);
+        return record;
+    }
+
+    // Blocks for recordN word writes. Stops at the first word that fails,
+    // before the header, so load() still returns the previous record.
+    static bool save(const uint32_t (&payload)[payloadN]) {
+        Record record = prepare(payload);
+        Eeprom::unlock();
+        bool ok = true;
+        for (size_t c = 0; c < recordN && ok; c++) {
+            ok = Eeprom::write(record.base + c, record.words[c]);
+        }
+        Eeprom::lock();
+        return ok;
+    }
+
+    // Slot of the newest valid record, slotsN if there is none. This reads
+    // one header per slot and normally checks a single CRC. Records are
+    // written to consecutive slots, so when the newest fails its CRC the
+    // slots before it are tried going back once around the log. Whatever
+    // the EEPROM holds, even another record size, this reads at most
+    // maxReads words.
+    static size_t newest() {
+        size_t best = slotsN;
+        uint16_t best_seq = 0;
+        for (size_t slot = 0; slot < slotsN; slot++) {
+            uint16_t seq = sequence(Eeprom::read(slot * recordN + payloadN));
+            if (seq != 0 && (best == slotsN || int16_t(seq - best_seq) > 0)) {
+                best = slot;
+                best_seq = seq;
+            }
+        }
+        if (best == slotsN) {
+            return slotsN;
+        }
+        for (size_t back = 0; back < slotsN; back++) {
+            size_t slot = (best + slotsN - back) % slotsN;
+            uint32_t header = Eeprom::read(slot * recordN + payloadN);
+            if (sequence(header) != 0 && valid(slot, header)) {
+                return slot;
+            }
+        }
+        return slotsN;
+    }
+
+    static constexpr size_t maxReads = slotsN * (recordN + 1);
+
+private:
+    static constexpr uint16_t sequence(uint32_t header) { return uint16_t(header >> 16); }
+
+    // Sequence numbers skip 0, which is what an erased header reads as.
+    static constexpr uint16_t next_seq(uint16_t seq) { return seq == 0xFFFF ? 1 : uint16_t(seq + 1); }
+
+    static bool valid(size_t slot, uint32_t header) {
+        uint32_t payload[payloadN];
+        for (size_t c = 0; c < payloadN; c++) {
+            payload[c] = Eeprom::read(slot * recordN + c);
+        }
+        return uint16_t(header) == crc(payload, sequence(header));
+    }
+
+    // CRC-16/CCITT over the payload and the sequence number.
+    static constexpr uint16_t crc(const uint32_t (&payload)[payloadN], uint16_t seq) {
+        uint16_t crc = 0xFFFF;
+        auto feed = [&crc](uint8_t byte) {
+            crc ^= uint16_t(byte << 8);
+            for (size_t bit = 0; bit < 8; bit++) {
+                crc = (crc & 0x8000) ? uint16_t((crc << 1) ^ 0x1021) : uint16_t(crc << 1);
+            }
+        };
+        for (size_t c = 0; c < payloadN; c++) {
+            for (size_t byte = 0; byte < 4; byte++) {
+                feed(uint8_t(payload[c] >> (byte * 8)));
+            }
+        }
+        feed(uint8_t(seq));
+        feed(uint8_t(seq >> 8));
+        return crc;
+    }
+};
+
+// Debounced button on PB1, pulled up and low while pressed. EXTI queues
+// every edge with the level it read and SysTick runs the timers in poll(), so
+// SysTick never reads the GPIO. A level must hold for debounceMs to count,
+// bounces restart the wait. Events are queued with the time of the edge that
+// settled, or when the long press threshold passed.
+class Button {
+public:
+    static constexpr uint32_t debounceMs = 30;
+    static constexpr uint32_t longMs = 800;
+    static constexpr uint32_t doubleMs = 300;
+
+    enum Type : uint8_t {
+        Press,
+        Release,
+        LongPress,
+        DoublePress
+    };
+
+    struct Event {
+        Type type;
+        uint32_t ms;
+    };
+
+    struct Edge {
+        uint32_t ms;
+        bool pressed;
+    };
+
+    static Button &instance();
+
+    // From EXTI. A full queue drops the edge, the next one brings the level
+    // back in sync.
+    void edge(bool pressed, uint32_t now_ms) {
+        edges.push({ now_ms, pressed });
+    }
+
+    // From SysTick, once per frame. Each queued edge first settles the level
+    // before it as of its own time, so a late poll still sees the bounces in
+    // order.
+    void poll(uint32_t now_ms) {
+        for (Edge e; edges.pop(e); ) {
+            settle(e.ms);
+            raw = e.pressed;
+            edge_ms = e.ms;
+        }
+        settle(now_ms);
+    }
+
+    bool pop(Event &event) {
+        return events.pop(event);
+    }
+
+private:
+    // The edge can be newer than now_ms, which is the last frame's time.
+    void settle(uint32_t now_ms) {
+        uint32_t settled_ms = edge_ms;
+        if (raw != down && int32_t(now_ms - settled_ms) >= int32_t(debounceMs)) {
+            down = raw;
+            if (down) {
+                push(Press, settled_ms);
+                spent = false;
+                if (clicked && settled_ms - released_ms <= doubleMs) {
+                    push(DoublePress, settled_ms);
+                    spent = true;
+                }
+                pressed_ms = settled_ms;
+            } else {
+                push(Release, settled_ms);
+                clicked = !spent;
+                released_ms = settled_ms;
+            }
+        }
+        if (down && !spent && int32_t(now_ms - pressed_ms) >= int32_t(longMs)) {
+            spent = true;
+            push(LongPress, pressed_ms + longMs);
+        }
+    }
+
+    // Drops the event when full, SysTick drains it every frame.
+    void push(Type type, uint32_t ms) {
+        events.push({ type, ms });
+    }
+
+    Queue<Edge, 4> edges;
+    uint32_t edge_ms = 0;
+    bool raw = false;
+    bool down = false;
+    bool spent = false;     // this press already was a long or double press
+    bool clicked = false;   // last press was a plain click, a quick second one is a double
+    uint32_t pressed_ms = 0;
+    uint32_t released_ms = 0;
+    Queue<Event, 4> events;
+};
+
+Button &Button::instance() {
+    static Button button;
+    return button;
+}
+
+// Settings, loaded from the log into RAM once at boot. version says how to
+// read the rest. migrate() brings anything older up to date and sanitize()
+// replaces out of range fields with their defaults, so a corrupted or blank
+// EEPROM can never hand the engine a bad value. The defaults are the member
+// initializers.
+struct Settings {
+    static constexpr uint8_t currentVersion = 3;
+
+    uint8_t version = currentVersion;
+    uint8_t pattern = 0;
+    uint8_t brightness = 255;   // 255 is full
+    uint8_t speed = 16;         // animation rate in 1/16ths
+    std::array<uint8_t, Leds::ledsN> calibration = full();   // per-LED gain, 255 is full
+    // Snapshot of the running animation, see Model::snapshot().
+    uint32_t seed = 0xDEADBEEF;
+    uint32_t phase = 0;
+
+    static constexpr size_t wordsN = (sizeof(uint8_t) * 4 + Leds::ledsN + 3) / 4 + 2;
+
+    // Version 0 is the raw pattern word from before the log, version 1 the
+    // first log records which held only the pattern, version 2 had no
+    // snapshot. Each lives in its own record layout, see Model::load(), and
+    // unpack() leaves the fields a version lacks at their defaults. Unknown
+    // versions fail.
+    bool migrate() {
+        switch (version) {
+            case 2:
+            case 3:
+                break;
+            default:
+                return false;
+        }
+        version = currentVersion;
+        return true;
+    }
+
+    void sanitize(size_t patternsN) {
+        Settings defaults;
+        if (pattern >= patternsN) {
+            pattern = defaults.pattern;
+        }
+        if (speed == 0 || speed > 64) {
+            speed = defaults.speed;
+        }
+    }
+
+    void pack(uint32_t (&words)[wordsN]) const {
+        memset(words, 0, sizeof(words));
+        memcpy(words, this, sizeof(Settings));
+    }
+
+    template<size_t n> void unpack(const uint32_t (&words)[n]) {
+        static_assert(n <= wordsN, "older layouts are never longer");
+        *this = Settings();
+        memcpy(this, words, std::min(sizeof(words), sizeof(Settings)));
+    }
+
+private:
+    static constexpr std::array<uint8_t, Leds::ledsN> full() {
+        std::array<uint8_t, Leds::ledsN> gains;
+        gains.fill(255);
+        return gains;
+    }
+};
+
+static_assert(sizeof(Settings) == Settings::wordsN * 4, "Settings must fill its words");
+
+class Model {
+public:
+
+    static constexpr size_t patternsN = Patterns::count;
+
+    static Model &instance();
+
+    size_t Pattern() const { return settings.pattern; }
+    void IncPattern() { settings.pattern = uint8_t(settings.pattern + 1u < patternsN ? settings.pattern + 1u : 0u); TRACE(PatternChange, settings.pattern); }
+    void DecPattern() { settings.pattern = uint8_t(settings.pattern > 0 ? settings.pattern - 1u : patternsN - 1u); TRACE(PatternChange, settings.pattern); }
+
+    using SettingsLog = EepromLog<Settings::wordsN>;
+    // Older record layouts, only read to migrate them.
+    using SettingsLogV2 = EepromLog<4>;
+    using SettingsLogV1 = EepromLog<1>;
+
+    void load();
+    bool save();
+    void apply();
+    void snapshot();
+    void resume();
+
+    Settings settings;
+
+    class pseudo_random {
+    public:
+        
+        void set_seed(uint32_t seed) {
+            uint32_t i;
+            a = 0xf1ea5eed, b = c = d = seed;
+            for (i=0; i<20; ++i) {
+                (void)get();
+            }
+        }
+
+        #define rot(x,k) (((x)<<(k))|((x)>>(32-(k))))
+        uint32_t get() {
+            uint32_t e = a - rot(b, 27);
+            a = b ^ rot(c, 17);
+            b = c + d;
+            c = d + e;
+            d = e + a;
+            return d;
+        }
+
+        uint32_t get(uint32_t lower, uint32_t upper) {
+            return (static_cast<int32_t>(get()) % (upper-lower)) + lower;
+        }
+
+    private:
+        uint32_t a; 
+        uint32_t b; 
+        uint32_t c; 
+        uint32_t d; 
+
+    } rnd;
+
+    void button(const Button::Event &event);
+
+private:
+    void init();
+    bool initialized = false;
+    bool consume_release = false;
+};
+
+Model &Model::instance() {
+    static Model model;
+    if (!model.initialized) {
+        model.initialized = true;
+        model.init();
+    }
+    return model;
+}
+
+void Model::load() {
+    uint32_t words[Settings::wordsN];
+    uint32_t v2[4];
+    uint32_t v1[1];
+    settings = Settings();
+    if (SettingsLog::load(words)) {
+        settings.unpack(words);
+        if (!settings.migrate()) {
+            settings = Settings();
+        }
+    } else if (SettingsLogV2::load(v2)) {
+        settings.unpack(v2);
+        if (settings.version != 2 || !settings.migrate()) {
+            settings = Settings();
+        }
+    } else if (SettingsLogV1::load(v1)) {
+        settings.pattern = uint8_t(std::min(v1[0], uint32_t(patternsN)));
+    } else {
+        // Boards saved before the log keep the pattern in the first word.
+        settings.pattern = uint8_t(std::min(Eeprom::read(0), uint32_t(patternsN)));
+    }
+    settings.sanitize(patternsN);
+}
+
+bool Model::save() {
+    TRACE(EepromSave, settings.pattern);
+    uint32_t words[Settings::wordsN];
+    settings.pack(words);
+    return SettingsLog::save(words);
+}
+
+// Pushes brightness, calibration and speed to where the frame uses them.
+void Model::apply() {
+    auto q8 = [](uint8_t v) { return uint32_t(v) + (v >> 7); };   // 255 to 256
+    for (size_t c = 0; c < Leds::ledsN; c++) {
+        Leds::gain[c] = uint16_t((q8(settings.brightness) * q8(settings.calibration[c])) >> 5);
+    }
+    Time::instance().set_rate(settings.speed);
+}
+
+// A click moves to the next pattern on release. A long press steps the
+// brightness, a double press steps the animation speed and takes back the
+// pattern change of its first click.
+void Model::button(const Button::Event &event) {
+    static constexpr uint8_t brightness[] = { 255, 128, 64, 32 };
+    static constexpr uint8_t speed[] = { 16, 32, 8 };
+    auto step = [](const auto &levels, uint8_t current) {
+        size_t c = 0;
+        while (c < std::size(levels) && levels[c] != current) {
+            c++;
+        }
+        return levels[(c + 1) % std::size(levels)];
+    };
+    switch (event.type) {
+        case Button::Press:
+            break;
+        case Button::Release:
+            if (consume_release) {
+                consume_release = false;
+            } else {
+                IncPattern();
+            }
+            break;
+        case Button::LongPress:
+            settings.brightness = step(brightness, settings.brightness);
+            consume_release = true;
+            break;
+        case Button::DoublePress:
+            DecPattern();
+            settings.speed = step(speed, settings.speed);
+            consume_release = true;
+            break;
+    }
+    if (event.type != Button::Press) {
+        apply();
+    }
+}
+
+void Model::init() {
+    load();
+    apply();
+    rnd.set_seed(settings.seed);
+}
+
+// Saves settings from the main loop once they have been left alone for
+// quietMs, so cycling through patterns costs one record instead of one per
+// press. The record goes out one word per wake-up, started right after the
+// SysTick frame so programming is done well before the next one.
+//
+// A snapshot of the animation goes out every snapshotMs as well. With 18
+// slots in the log that is one write per word every 3 hours, about 2900 a
+// year against the 100000 cycles the data EEPROM is rated for.
+class Persist {
+public:
+    static constexpr uint32_t quietMs = 3000;
+    static constexpr uint32_t snapshotMs = 10 * 60 * 1000;
+
+    static Persist &instance();
+
+    // From SysTick whenever a setting changes. A full queue loses only a
+    // newer time, the save then comes a little early but still picks up the
+    // settings as they are by then.
+    void changed(uint32_t now_ms) {
+        if (immediate && Model::instance().save()) {
+            return;
+        }
+        changes.push(now_ms);
+    }
+
+    // From the main loop after every wake-up. A word that fails to program
+    // ends the record before its header, so the log still ends at the
+    // previous one, and the settings are saved again after quietMs.
+    void service(uint32_t now_ms) {
+        receive();
+        if (writing) {
+            if (Eeprom::busy()) {
+                return;
+            }
+            bool failed = next != 0 && !Eeprom::succeeded();
+            if (!failed && next < Model::SettingsLog::recordN) {
+                if (next == 0) {
+                    Eeprom::unlock();
+                }
+                Eeprom::start(record.base + next, record.words[next]);
+                next++;
+                return;
+            }
+            Eeprom::lock();
+            writing = false;
+            if (failed) {
+                dirty = true;
+                changed_ms = now_ms;
+            }
+            return;
+        }
+        if ((dirty && now_ms - changed_ms >= quietMs) || now_ms - saved_ms >= snapshotMs) {
+            dirty = false;
+            saved_ms = now_ms;
+            TRACE(EepromSave, uint8_t(Model::instance().Pattern()));
+            Model::instance().snapshot();
+            uint32_t words[Settings::wordsN];
+            Model::instance().settings.pack(words);
+            record = Model::SettingsLog::prepare(words);
+            next = 0;
+            writing = true;
+        }
+    }
+
+    // Finishes any pending save and saves a fresh snapshot right away, for
+    // a power-down hint or before Stop mode.
+    void flush() {
+        while (writing) {
+            service(changed_ms);
+        }
+        receive();
+        Model::instance().snapshot();
+        dirty = !Model::instance().save();
+    }
+
+    bool idle() const { return !dirty && !writing && changes.empty(); }
+
+#ifndef USE_HAL_DRIVER
+    // Save inside SysTick as before, for comparing.
+    static bool immediate;
+#else  // #ifndef USE_HAL_DRIVER
+    static constexpr bool immediate = false;
+#endif  // #ifndef USE_HAL_DRIVER
+
+private:
+    void receive() {
+        for (uint32_t ms; changes.pop(ms); ) {
+            changed_ms = ms;
+            dirty = true;
+        }
+    }
+
+    Queue<uint32_t, 2> changes;
+    Model::SettingsLog::Record record { };
+    size_t next = 0;
+    uint32_t changed_ms = 0;
+    uint32_t saved_ms = 0;
+    bool dirty = false;
+    bool writing = false;
+};
+
+#ifndef USE_HAL_DRIVER
+bool Persist::immediate = false;
+#endif  // #ifndef USE_HAL_DRIVER
+
+Persist &Persist::instance() {
+    static Persist persist;
+    return persist;
+}
+
+extern "C" void Persist_Service(void) {
+    Persist::instance().service(Time::instance().real_ms());
+}
+
+// Performance block, read out together with the trace ring. Stack depths are
+// in bytes measured from the top of RAM. A frame counts as dropped when the
+// SysTick handler runs past the next tick; on the host, when it had to wait
+// for EEPROM programming. A frame counts as cut when the LED DMA had not
+// finished the previous one yet.
+class Perf {
+public:
+    static constexpr uint32_t magic = 0x46524550; // "PERF"
+
+    enum Isr : uint8_t {
+        SysTickIsr,
+        ExtiIsr,
+        DmaIsr,
+        isrsN
+    };
+
+    struct Block {
+        uint32_t magic;
+        uint16_t patterns;      // in this pack, sizes stack_pattern
+        uint16_t stack_pattern[Model::patternsN];
+        uint16_t stack_isr[isrsN];
+        uint16_t frames_dropped;
+        uint16_t frames_cut;
+    };
+
+    static void stack_pattern(size_t pattern, uint32_t depth) {
+        block.stack_pattern[pattern] = std::max(block.stack_pattern[pattern], uint16_t(depth));
+    }
+
+    static void stack_isr(Isr isr, uint32_t depth) {
+        block.stack_isr[isr] = std::max(block.stack_isr[isr], uint16_t(depth));
+    }
+
+    static void frame_begin() {
+#ifdef USE_HAL_DRIVER
+        (void)SysTick->CTRL;   // clears COUNTFLAG
+#else  // #ifdef USE_HAL_DRIVER
+        Eeprom::stall();
+        frame_stall_us = Eeprom::stall_us;
+#endif  // #ifdef USE_HAL_DRIVER
+    }
+
+    static void frame_end() {
+#ifdef USE_HAL_DRIVER
+        bool dropped = (SysTick->CTRL & SysTick_CTRL_COUNTFLAG_Msk) != 0;
+#else  // #ifdef USE_HAL_DRIVER
+        bool dropped = Eeprom::stall_us != frame_stall_us;
+#endif  // #ifdef USE_HAL_DRIVER
+        if (dropped && block.frames_dropped != 0xFFFF) {
+            block.frames_dropped++;
+        }
+    }
+
+    static void frame_cut() {
+        if (block.frames_cut != 0xFFFF) {
+            block.frames_cut++;
+        }
+    }
+
+    static Block block;
+
+#ifndef USE_HAL_DRIVER
+    static uint32_t frame_stall_us;
+#endif  // #ifndef USE_HAL_DRIVER
+};
+
+Perf::Block Perf::block = { Perf::magic, Model::patternsN, { }, { }, 0, 0 };
+
+#ifndef USE_HAL_DRIVER
+uint32_t Perf::frame_stall_us = 0;
+#endif  // #ifndef USE_HAL_DRIVER
+
+#ifdef USE_HAL_DRIVER
+extern "C" uint32_t _ebss;
+extern "C" uint32_t _estack;
+#endif  // #ifdef USE_HAL_DRIVER
+
+// Stack painting. Everything between the end of .bss and the stack pointer is
+// filled with a pattern at boot. A Probe scans down from where it was created
+// to the last dirty word when done, then the outermost probe repaints what was
+// used so the next measurement starts clean. Nested probes (EXTI or DMA
+// preempting SysTick) report the absolute depth including the frame they
+// interrupted.
+class Stack {
+public:
+    static constexpr uint32_t paint = 0xC5C5C5C5;
+
+    static void paint_free() {
+        uint32_t *end = std::min(top(), reinterpret_cast<uint32_t *>(current() & ~uintptr_t(3)));
+        for (uint32_t *p = bottom(); p < end; p++) {
+            *p = paint;
+        }
+    }
+
+    static uint32_t high_water() {
+        uint32_t depth = 0;
+        for (size_t c = 0; c < Model::patternsN; c++) {
+            depth = std::max(depth, uint32_t(Perf::block.stack_pattern[c]));
+        }
+        for (size_t c = 0; c < Perf::isrsN; c++) {
+            depth = std::max(depth, uint32_t(Perf::block.stack_isr[c]));
+        }
+        return depth;
+    }
+
+    class Probe {
+    public:
+        Probe() : start(current()) {
+            nesting++;
+        }
+
+        uint32_t done() {
+            if (!bottom()) {
+                nesting--;
+                return 0;
+            }
+#ifdef USE_HAL_DRIVER
+            uint32_t primask = __get_PRIMASK();
+            __disable_irq();
+#endif  // #ifdef USE_HAL_DRIVER
+            uint32_t *lowest = reinterpret_cast<uint32_t *>(start & ~uintptr_t(3));
+            size_t clean = 0;
+            for (uint32_t *p = lowest - 1; p >= bottom() && clean < 4; p--) {
+                if (*p == paint) {
+                    clean++;
+                } else {
+                    clean = 0;
+                    lowest = p;
+                }
+            }
+            if (--nesting == 0) {
+                uint32_t *end = reinterpret_cast<uint32_t *>(current() & ~uintptr_t(3));
+                for (uint32_t *p = lowest; p < end; p++) {
+                    *p = paint;
+                }
+            }
+#ifdef USE_HAL_DRIVER
+            __set_PRIMASK(primask);
+#endif  // #ifdef USE_HAL_DRIVER
+            return uint32_t(reinterpret_cast<uintptr_t>(top()) - reinterpret_cast<uintptr_t>(lowest));
+        }
+
+    private:
+        uintptr_t start;
+    };
+
+#ifdef USE_HAL_DRIVER
+    static uint32_t *bottom() { return &_ebss; }
+    static uint32_t *top() { return &_estack; }
+#else  // #ifdef USE_HAL_DRIVER
+    // The host has no painted stack unless emulate() switched to one.
+    static uint32_t *bottom() { return region_bottom; }
+    static uint32_t *top() { return region_top; }
+
+    static uint32_t *region_bottom;
+    static uint32_t *region_top;
+#endif  // #ifdef USE_HAL_DRIVER
+
+private:
+#ifdef USE_HAL_DRIVER
+    static uintptr_t current() {
+        return __get_MSP();
+#else  // #ifdef USE_HAL_DRIVER
+    // Not inlined so the marker lies below the caller's live frame.
+    __attribute__((noinline)) static uintptr_t current() {
+        volatile uint32_t marker = 0;
+        return reinterpret_cast<uintptr_t>(&marker);
+#endif  // #ifdef USE_HAL_DRIVER
+    }
+
+    static volatile uint32_t nesting;
+};
+
+volatile uint32_t Stack::nesting = 0;
+#ifndef USE_HAL_DRIVER
+uint32_t *Stack::region_bottom = nullptr;
+uint32_t *Stack::region_top = nullptr;
+#endif  // #ifndef USE_HAL_DRIVER
+
+extern "C" void Stack_Paint(void) {
+    Stack::paint_free();
+}
+
+// Called from the IRQ handlers in stm32l0xx_it.c, which CubeMX generates
+// without the HAL handler calls. LED completions are stamped with the frame
+// time, button edges with Time::irq_ms() so each bounce has its own time.
+extern "C" void Leds_DmaIrq(void) {
+    Stack::Probe probe;
+    if (drivers::SpiDma::irq()) {
+        Leds::completed.push(Time::instance().real_ms());
+    }
+    Perf::stack_isr(Perf::DmaIsr, probe.done());
+}
+
+extern "C" void Button_ExtiIrq(void) {
+    Stack::Probe probe;
+    bool pressed;
+    if (drivers::ButtonLine::irq(pressed)) {
+        TRACE(ButtonEdge, pressed);
+        Button::instance().edge(pressed, Time::irq_ms());
+    }
+    Perf::stack_isr(Perf::ExtiIsr, probe.done());
+}
+
+// Patterns are written as shaders. prepare() runs once per frame and puts
+// everything that does not depend on the LED into Uniforms, shade() computes
+// one LED from its index and the uniforms. A pattern with visit() shades only
+// the LEDs visit() reports and shows its background() everywhere else. A
+// diffuse rate blurs the result over the LED graph. Patterns and looks marked
+// radial depend only on the radius, their shade() runs once per radius class
+// in Radial. Patterns that are not animated render once on entry.
+// Anything a pattern keeps between frames goes in its State, which lives in
+// Arena while the pattern runs and is passed to prepare(). A State::osc is the
+// pattern's entry in the oscillator bank and is advanced once per frame. The
+// hue cycles run backwards, as the original 1 - tick ramps did. keyframeHz
+// opts smooth patterns without random state into Interpolator, 0 renders
+// every frame.
+
+// Kernels are patterns that several looks share. A look names its Kernel and
+// gives it a constexpr params record of colours, speeds and per-LED tables.
+// Patterns runs a look on its kernel's code, so each kernel is linked once and
+// a further look costs its record, its Patterns entry and any per-LED table it
+// adds. Kernels read the running look's record with Look::params().
+
+// Two colours blended along a per-LED coordinate.
+class GradientKernel {
+public:
+    static constexpr bool animated = false;
+    static constexpr uint8_t keyframeHz = 0;
+
+    struct Params {
+        rgb from;
+        rgb to;
+        const fixed32<20> *coord;   // 0..1
+    };
+
+    struct Uniforms { };
+
+    static rgb at(size_t c, const Params &p) {
+        return lerp(p.from, p.to, p.coord[c]);
+    }
+
+    static void prepare(uint32_t, Uniforms &) {
+    }
+
+    static rgb shade(size_t c, const Uniforms &) {
+        return at(c, Look::params<GradientKernel>());
+    }
+};
+
+// Hue from an oscillator, shifted by a phase offset per LED, with saturation
+// and value per LED.
+class HueScrollKernel {
+public:
+    static constexpr bool animated = true;
+    static constexpr uint8_t keyframeHz = 25;
+
+    struct Params {
+        Oscillator osc;
+        const uint32_t *offset;
+        const fixed32<20> *saturation;
+        const fixed32<20> *value;
+    };
+
+    struct State {
+        Oscillator osc = Look::params<HueScrollKernel>().osc;
+    };
+
+    struct Uniforms {
+        Oscillator::Frame h;
+        const Params *p;
+    };
+
+    static void prepare(uint32_t ms, State &s, Uniforms &u) {
+        u.h = s.osc.at(ms);
+        u.p = &Look::params<HueScrollKernel>();
+    }
+
+    static rgb shade(size_t c, const Uniforms &u) {
+        return rgb(hsv(u.h(u.p->offset[c]), u.p->saturation[c], u.p->value[c]));
+    }
+};
+
+// A line sweeping across a gradient at a random angle, starting over after a
+// random number of seconds.
+class SweepKernel {
+public:
+    static constexpr bool animated = true;
+    static constexpr uint8_t keyframeHz = 0;
+
+    struct Params {
+        GradientKernel::Params background;
+        fixed32<20> hue;            // of the line
+        fixed32<20> saturation;
+        fixed32<20> speed;          // line widths per second
+        uint8_t min_s;              // seconds between sweeps, min_s..max_s - 1
+        uint8_t max_s;
+    };
+
+    struct State {
+        uint32_t prev_ms = 0;
+        uint32_t next_ms = 0;
+        fixed32<20> angle;
+        uint8_t direction = 0;
+        bool started = false;
+    };
+
+    struct Uniforms {
+        fixed32<20> sweep;
+        fixed32<20> ca;
+        fixed32<20> sa;
+        uint8_t direction;
+        const Params *p;
+    };
+
+    // 8 directions keep the index at 288 bytes of flash.
+    static constexpr auto index = BandIndex<Leds::ledsN, 8>::build(Geometry::cx, Geometry::cy);
+
+    static void prepare(uint32_t ms, State &s, Uniforms &u) {
+        auto &p = Look::params<SweepKernel>();
+        if ( !s.started || int32_t(ms - s.next_ms) >= 0 ) {
+            s.prev_ms = s.started ? s.next_ms : ms;
+            s.next_ms = ms + Model::instance().rnd.get(p.min_s,p.max_s) * 1000;
+            int32_t turn = int32_t(Model::instance().rnd.get(0,256));
+            s.angle = fixed32<20>(6.283185307179f/256.0f)*fixed32<20>(turn);
+            s.direction = uint8_t(decltype(index)::nearest(turn));
+            s.started = true;
+        }
+        u.sweep = fixed32<20>(Time::seconds(ms - s.prev_ms)) * p.speed;
+        u.ca = cos(s.angle);
+        u.sa = sin(s.angle);
+        u.direction = s.direction;
+        u.p = &p;
+    }
+
+    // Only LEDs with |sweep + projection| < 1 are lit.
+    template<typename F> static void visit(const Uniforms &u, F f) {
+        index.visit(u.direction, u.ca, u.sa, -fixed32<20>(1.0f) - u.sweep, fixed32<20>(1.0f) - u.sweep, f);
+    }
+
+    static rgb background(size_t c, const Uniforms &u) {
+        return GradientKernel::at(c, u.p->background);
+    }
+
+    static rgb shade(size_t c, const Uniforms &u) {
+        rgb out = background(c, u);
+        fixed32<20> x = u.sweep +
+            (Geometry::cx[c] * u.ca - Geometry::cy[c] * u.sa);
+        if (x.abs() < fixed32<20>(1.0f)) {
+            auto b = ((x.abs().reflect() - fixed32<20>(0.5f)) * fixed32<20>(4.0f)).clamp(fixed32<20>(0.0f), fixed32<20>(1.0f));
+            out += rgb(hsv(u.p->hue, u.p->saturation, b)) * fixed32<20>(4.0f);
+        }
+        return out;
+    }
+};
+
+// Two random LEDs per frame in random grey levels, or random colours. If both
+// picks hit the same LED the second one wins, as before.
+class SparkleKernel {
+public:
+    static constexpr bool animated = true;
+    static constexpr uint8_t keyframeHz = 0;
+
+    struct Params {
+        bool colour;
+    };
+
+    struct Uniforms {
+        size_t led[2];
+        rgb col[2];
+    };
+
+    static void prepare(uint32_t, Uniforms &u) {
+        bool colour = Look::params<SparkleKernel>().colour;
+        for (size_t c = 0; c < 2; c++) {
+            u.led[c] = Model::instance().rnd.get(0,Leds::ledsN);
+            if (colour) {
+                u.col[c] = rgb(
+                    fixed32<20>(1.0f/127.0f)*fixed32<20>(Model::instance().rnd.get(0,127)),
+                    fixed32<20>(1.0f/127.0f)*fixed32<20>(Model::instance().rnd.get(0,127)),
+                    fixed32<20>(1.0f/127.0f)*fixed32<20>(Model::instance().rnd.get(0,127)));
+            } else {
+                auto v = fixed32<20>(1.0f/127.0f)*fixed32<20>(Model::instance().rnd.get(0,127));
+                u.col[c] = rgb(v, v, v);
+            }
+        }
+    }
+
+    static rgb shade(size_t c, const Uniforms &u) {
+        return c == u.led[1] ? u.col[1] : c == u.led[0] ? u.col[0] : rgb();
+    }
+};
+
+// Gold background with a white line sweeping across at a random angle.
+class Sweep {
+public:
+    using Kernel = SweepKernel;
+    static constexpr Kernel::Params params = {
+        { rgb(0xBB9900), rgb(0xAA5500), Geometry::inner.data() },
+        fixed32<20>(0.0f), fixed32<20>(0.0f), fixed32<20>(6.0f), 6, 24
+    };
+};
+
+// Whole badge cycles through the hues, saturation and value by depth.
+class HueCycle {
+public:
+    using Kernel = HueScrollKernel;
+    static constexpr bool radial = true;
+    static constexpr Kernel::Params params = {
+        Oscillator(-0.02f, Oscillator::Saw), Geometry::no_offset.data(), Geometry::inner.data(), Geometry::falloff.data()
+    };
+};
+
+// Rainbow rotating around the centre.
+class Spin {
+public:
+    static constexpr bool animated = true;
+    static constexpr uint8_t keyframeHz = 25;
+
+    struct State {
+        Oscillator osc = Oscillator(-0.08f, Oscillator::Saw);
+    };
+
+    struct Uniforms {
+        fixed32<20> ch;
+        fixed32<20> sh;
+        fixed32<20> t6;
+    };
+
+    static void prepare(uint32_t ms, State &s, Uniforms &u) {
+        auto t = s.osc.at(ms);
+        u.ch = Oscillator::shape(Oscillator::Sine, t.base + 0x40000000);
+        u.sh = Oscillator::shape(Oscillator::Sine, t.base);
+        u.t6 = Oscillator::shape(Oscillator::Saw, t.base * 6) + fixed32<20>(0.5f);
+    }
+
+    static rgb shade(size_t c, const Uniforms &u) {
+        auto x = Geometry::cx[c] * u.ch - Geometry::cy[c] * u.sh;
+        auto hue((x * fixed32<20>(0.5f) + u.t6).frac());
+        return rgb(hsv(hue, fixed32<20>(1.0f), Geometry::falloff95[c]));
+    }
+};
+
+// Rainbow running diagonally.
+class Diagonal {
+public:
+    using Kernel = HueScrollKernel;
+
+    static constexpr auto offset = led_table<uint32_t>([](size_t, fixed32<20> x, fixed32<20> y) {
+        return Oscillator::offset(x * y * fixed32<20>(1.0f / 2.0f));
+    }, Leds::x, Leds::y);
+
+    static constexpr Kernel::Params params = {
+        Oscillator(-0.02f, Oscillator::Saw), offset.data(), Geometry::full.data(), Geometry::falloff95.data()
+    };
+};
+
+// Slow rainbow running horizontally.
+class Scroll {
+public:
+    using Kernel = HueScrollKernel;
+
+    static constexpr auto offset = led_table<uint32_t>([](size_t, fixed32<20> x) {
+        return -Oscillator::offset(x * fixed32<20>(1.0f / 8.0f));
+    }, Leds::x);
+
+    static constexpr Kernel::Params params = {
+        Oscillator(-0.01f, Oscillator::Saw), offset.data(), Geometry::full.data(), Geometry::falloff95.data()
+    };
+};
+
+// Two random LEDs per frame in random grey levels.
+class Sparkle {
+public:
+    using Kernel = SparkleKernel;
+    static constexpr Kernel::Params params = { false };
+};
+
+// Two random LEDs per frame in random colours.
+class Confetti {
+public:
+    using Kernel = SparkleKernel;
+    static constexpr Kernel::Params params = { true };
+};
+
+// Static red to blue gradient by depth.
+class Gradient {
+public:
+    using Kernel = GradientKernel;
+    static constexpr bool radial = true;
+    static constexpr Kernel::Params params = { rgb(0xFF1111), rgb(0x1111FF), Geometry::inner.data() };
+};
+
+// Static warm glow.
+class Glow {
+public:
+    static constexpr bool animated = false;
+    static constexpr uint8_t keyframeHz = 0;
+    static constexpr bool radial = true;
+
+    struct Uniforms { };
+
+    static void prepare(uint32_t, Uniforms &) {
+    }
+
+    static rgb shade(size_t c, const Uniforms &) {
+        return rgb(hsv(fixed32<20>(0.1f), fixed32<20>(1.00f) + fixed32<20>(1.50f) * Leds::radius[c], fixed32<20>(1.0f) - fixed32<20>(0.9f) * Leds::radius[c]));
+    }
+};
+
+// Drops falling on water. Heights follow the wave equation over the LED
+// graph at a fixed 50Hz step and the colours are blurred across neighbours.
+class Ripple {
+public:
+    static constexpr bool animated = true;
+    static constexpr uint8_t keyframeHz = 0;
+    static constexpr uint32_t step_ms = 20;
+    static constexpr auto diffuse = fixed32<20>(0.25f);
+
+    // Heights in Q12, two generations.
+    struct State {
+        int16_t height[2][Leds::ledsN] = { };
+        uint8_t current = 0;
+        bool started = false;
+        uint32_t stepped_ms = 0;
+        uint32_t drop_ms = 0;
+    };
+
+    struct Uniforms {
+        const int16_t *height;
+    };
+
+    static void step(State &s) {
+        const int16_t *now = s.height[s.current];
+        int16_t *next = s.height[s.current ^ 1];
+        for (size_t c = 0; c < Leds::ledsN; c++) {
+            int32_t sum = 0;
+            Graph::neighbours(c, [&](size_t n) {
+                sum += now[n];
+            });
+            // Twice the neighbour average, inverse degree taken down to Q12
+            // so the product stays in 32 bits.
+            int32_t h = ((sum * (Graph::inv_degree[c].raw >> 8)) >> 11) - next[c];
+            next[c] = int16_t(std::clamp(h - h / 32, int32_t(-8192), int32_t(8192)));
+        }
+        s.current ^= 1;
+    }
+
+    static void prepare(uint32_t ms, State &s, Uniforms &u) {
+        if (!s.started) {
+            s.stepped_ms = ms;
+            s.drop_ms = ms;
+            s.started = true;
+        }
+        if (int32_t(ms - s.drop_ms) >= 0) {
+            s.height[s.current][Model::instance().rnd.get(0,Leds::ledsN)] = 4096;
+            s.drop_ms = ms + 400 + Model::instance().rnd.get(0,1200);
+        }
+        for (size_t n = 0; int32_t(ms - s.stepped_ms) >= int32_t(step_ms); n++) {
+            if (n == 4) {
+                s.stepped_ms = ms;
+                break;
+            }
+            step(s);
+            s.stepped_ms += step_ms;
+        }
+        u.height = s.height[s.current];
+    }
+
+    static rgb shade(size_t c, const Uniforms &u) {
+        fixed32<20> v;
+        v.raw = std::abs(int32_t(u.height[c])) << 8;
+        v = v.clamp(fixed32<20>(0.0f), fixed32<20>(1.0f));
+        return rgb(hsv(fixed32<20>(0.58f), fixed32<20>(1.0f) - v * fixed32<20>(0.6f), fixed32<20>(0.06f) + v));
+    }
+};
+
+// Per-pattern state arena. Only one pattern runs at a time, so the States of
+// all patterns overlay one buffer sized for the largest. enter() destroys the
+// running pattern's State and constructs the next one in place, so adding
+// stateful patterns does not grow RAM beyond the largest State. The size is
+// Arena::storage in the .map file and is printed by the host "patterns" mode.
+class Arena {
+public:
+    static constexpr size_t size = Patterns::state_max();
+    static_assert(size <= 64, "pattern State over the RAM budget");
+
+    template<typename P> static typename P::State &state() {
+        return *std::launder(reinterpret_cast<typename P::State *>(storage));
+    }
+
+    template<typename P> static void construct() {
+        new (storage) typename P::State();
+    }
+
+    template<typename P> static void destroy() {
+        state<P>().~State();
+    }
+
+    static void enter(size_t pattern);
+
+    // Pattern whose State is in the arena.
+    static size_t current() { return active; }
+
+private:
+    alignas(uint32_t) static uint8_t storage[size];
+    static size_t active;
+};
+
+alignas(uint32_t) uint8_t Arena::storage[Arena::size];
+size_t Arena::active = ~size_t(0);
+
+// Fills out with f(c), once per radius class when the running pattern is
+// radial. A kernel that only some radial looks run on decides at run time.
+template<typename P, typename F> static void shade_leds(rgb *out, F f) {
+    if constexpr (Patterns::radial_any<P>()) {
+        if (Patterns::radial_all<P>() || Look::radial) {
+            Radial::shade(out, f);
+            return;
+        }
+    }
+    for (size_t c = 0; c < Leds::ledsN; c++) {
+        out[c] = f(c);
+    }
+}
+
+// The one per-LED loop all patterns run through.
+template<typename P> static void draw(uint32_t ms) {
+    typename P::Uniforms u;
+    if constexpr (requires { typename P::State; }) {
+        P::prepare(ms, Arena::state<P>(), u);
+    } else {
+        P::prepare(ms, u);
+    }
+    if constexpr (requires { P::visit(u, [](size_t) { }); }) {
+        // shade() only differs from background() on the LEDs visit() reports.
+        for (size_t c = 0; c < Leds::ledsN; c++) {
+            Leds::led_buffer[c] = P::background(c, u);
+        }
+        P::visit(u, [&](size_t c) {
+            Leds::led_buffer[c] = P::shade(c, u);
+        });
+    } else {
+        shade_leds<P>(Leds::led_buffer, [&](size_t c) { return P::shade(c, u); });
+    }
+    if constexpr (requires { P::diffuse; }) {
+        Graph::diffuse(Leds::led_buffer, P::diffuse);
+    }
+}
+
+template<typename P> static constexpr void (*enter_of())() {
+    if constexpr (requires { typename P::State; }) {
+        return &Arena::construct<P>;
+    } else {
+        return nullptr;
+    }
+}
+
+template<typename P> static constexpr void (*exit_of())() {
+    if constexpr (requires { typename P::State; }) {
+        if constexpr (!std::is_trivially_destructible_v<typename P::State>) {
+            return &Arena::destroy<P>;
+        }
+    }
+    return nullptr;
+}
+
+template<typename P> static constexpr void (*advance_of())(uint32_t) {
+    if constexpr (requires { typename P::State; Arena::state<P>().osc; }) {
+        return [](uint32_t now_ms) { Arena::state<P>().osc.advance(now_ms); };
+    } else {
+        return nullptr;
+    }
+}
+
+template<typename P> static constexpr Oscillator *(*osc_of())() {
+    if constexpr (requires { typename P::State; Arena::state<P>().osc; }) {
+        return []() { return &Arena::state<P>().osc; };
+    } else {
+        return nullptr;
+    }
+}
+
+template<typename P> static constexpr const void *params_of() {
+    if constexpr (requires { P::params; }) {
+        return &P::params;
+    } else {
+        return nullptr;
+    }
+}
+
+template<typename... P> constexpr typename Registry<P...>::Info Registry<P...>::info[] = {
+    { &draw<kernel_of<P>>, enter_of<kernel_of<P>>(), exit_of<kernel_of<P>>(), advance_of<kernel_of<P>>(), osc_of<kernel_of<P>>(), params_of<P>(),
+      uint16_t(kernel_of<P>::keyframeHz ? 1000 / kernel_of<P>::keyframeHz : 0), uint8_t(sizeof(typename kernel_of<P>::Uniforms)),
+      uint8_t(state_size<kernel_of<P>>()), kernel_of<P>::animated, requires { P::radial; } }...
+};
+
+void Arena::enter(size_t pattern) {
+    if (active < Patterns::count && Patterns::info[active].exit) {
+        Patterns::info[active].exit();
+    }
+    active = pattern;
+    Look::current = Patterns::info[pattern].params;
+    Look::radial = Patterns::info[pattern].radial;
+    if (Patterns::info[pattern].enter) {
+        Patterns::info[pattern].enter();
+    }
+}
+
+// Puts the RNG and the running pattern's phase into settings so the next boot
+// carries on from here. The RNG state is 16 bytes, so it is reseeded from
+// itself and only the 4 byte seed is kept. The phase is taken one frame
+// ahead, where the next frame would have been. Runs in the main loop,
+// SysTick must not step either halfway.
+void Model::snapshot() {
+#ifdef USE_HAL_DRIVER
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+#endif  // #ifdef USE_HAL_DRIVER
+    settings.seed = rnd.get();
+    rnd.set_seed(settings.seed);
+    auto osc = Patterns::info[settings.pattern].osc;
+    settings.phase = osc && Arena::current() == settings.pattern ? osc()->snapshot(Time::instance().ms() + Time::instance().delta_ms()) : 0;
+#ifdef USE_HAL_DRIVER
+    __set_PRIMASK(primask);
+#endif  // #ifdef USE_HAL_DRIVER
+}
+
+// Restores the phase from the snapshot, once the pattern from boot has
+// entered the arena.
+void Model::resume() {
+    auto osc = Patterns::info[settings.pattern].osc;
+    if (osc && Arena::current() == settings.pattern) {
+        osc()->resume(settings.phase, Time::instance().ms());
+    }
+}
+
+// ms is the animation time from Time, it may be ahead of the current frame.
+static void render(size_t pattern, uint32_t ms) {
+    Patterns::info[pattern].draw(ms);
+}
+
+#ifndef USE_HAL_DRIVER
+// Measurement runs on the host render without the terminal preview.
+static bool host_display = true;
+#endif  // #ifndef USE_HAL_DRIVER
+
+// Boot. HAL_Init() starts SysTick at 1 kHz on the 2.1 MHz MSI clock, before
+// SystemClock_Config() and before the SPI exists, so SysTick leaves frames
+// alone until main() has set things up and calls Boot_FirstFrame(). That
+// renders the restored pattern and starts its DMA straight away from the main
+// context, SysTick takes over from the next tick.
+class Boot {
+public:
+    static volatile bool running;
+};
+
+#ifdef USE_HAL_DRIVER
+volatile bool Boot::running = false;
+#else  // #ifdef USE_HAL_DRIVER
+volatile bool Boot::running = true;
+#endif  // #ifdef USE_HAL_DRIVER
+
+static void frame() {
+    Stack::Probe probe;
+    Perf::frame_begin();
+
+    auto &button = Button::instance();
+    button.poll(Time::instance().real_ms());
+    for (Button::Event event; button.pop(event); ) {
+        if (event.type != Button::Press) {
+            Model::instance().button(event);
+            Persist::instance().changed(Time::instance().real_ms());
+        }
+    }
+
+    auto &time = Time::instance();
+    time.advance();
+
+    static size_t current_pattern = ~size_t(0);
+    bool entered = current_pattern != Model::instance().Pattern();
+    if (entered) {
+        bool booted = current_pattern == ~size_t(0);
+        current_pattern = Model::instance().Pattern();
+        Arena::enter(current_pattern);
+        if (booted) {
+            Model::instance().resume();
+        }
+        Interpolator::instance().invalidate();
+        TRACE(PatternFrame, current_pattern);
+    }
+
+    size_t pattern = Model::instance().Pattern();
+    auto &info = Patterns::info[pattern];
+    if (info.advance) {
+        info.advance(time.ms());
+    }
+    if (!info.animated && !entered && !Interpolator::bypass) {
+        // Static pattern, led_buffer still holds the frame from entry.
+    } else if (info.keyframe_ms == 0 || Interpolator::bypass) {
+        render(pattern, time.ms());
+    } else {
+        auto &interpolator = Interpolator::instance();
+        if (interpolator.begin(time.ms(), info.keyframe_ms)) {
+            if (!interpolator.primed()) {
+                render(pattern, interpolator.key_ms());
+                interpolator.push(Leds::led_buffer);
+            }
+            render(pattern, interpolator.next_ms());
+            interpolator.push(Leds::led_buffer);
+        }
+        interpolator.blend(Leds::led_buffer, time.ms());
+    }
+#ifndef USE_HAL_DRIVER
+    if (host_display) {
+    printf("\033[0H"); fflush(stdout);    
+    Leds::each([](size_t c, fixed32<20> x, fixed32<20> y) {
+        printf("\033[%d;%dH\033[48;2;%d;%d;%dm  \033[48;2;0;0;0m",
+            16-static_cast<int32_t>(y * fixed32<20>(16)),
+               static_cast<int32_t>(x * fixed32<20>(32)),
+            int32_t(std::clamp(float(Leds::led_buffer[c].r), 0.0f, 1.0f)*255.0f),
+            int32_t(std::clamp(float(Leds::led_buffer[c].g), 0.0f, 1.0f)*255.0f),
+            int32_t(std::clamp(float(Leds::led_buffer[c].b), 0.0f, 1.0f)*255.0f));
+    }, Leds::x, Leds::y);
+    }
+#endif  // #ifndef USE_HAL_DRIVER
+
+    if (!Leds::instance().sent()) {
+        Perf::frame_cut();
+    }
+    Leds::instance().transfer();
+
+    uint32_t depth = probe.done();
+    Perf::stack_pattern(pattern, depth);
+    Perf::stack_isr(Perf::SysTickIsr, depth);
+    Perf::frame_end();
+}
+
+extern "C" void HAL_SysTick_User(void) {
+    if (Boot::running) {
+        frame();
+    }
+}
+
+extern "C" void Boot_FirstFrame(void) {
+    frame();
+    Boot::running = true;
+}
+
+#ifndef USE_HAL_DRIVER
+#ifndef WIN32
+// Runs every pattern on a painted stack with a guard page below it and prints
+// the deepest use per pattern. x86/ARM64 frames are larger than Cortex-M0+
+// frames, so compare patterns against each other rather than against the
+// linker script's _Min_Stack_Size.
+static ucontext_t host_main_context;
+static ucontext_t host_stack_context;
+
+static void host_stack_frames() {
+    for (size_t c = 0; c < 1000; c++) {
+        HAL_SysTick_User();
+    }
+}
+
+static int host_stack() {
+    constexpr size_t guard = 4096;
+    constexpr size_t size = 64 * 1024;
+
+    auto base = static_cast<uint8_t *>(mmap(nullptr, guard + size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    if (base == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    mprotect(base, guard, PROT_NONE);
+
+    Stack::region_bottom = reinterpret_cast<uint32_t *>(base + guard);
+    Stack::region_top = reinterpret_cast<uint32_t *>(base + guard + size);
+    Stack::paint_free();
+
+    host_display = false;
+    for (size_t p = 0; p < Model::patternsN; p++) {
+        while (Model::instance().Pattern() != p) {
+            Model::instance().IncPattern();
+        }
+        getcontext(&host_stack_context);
+        host_stack_context.uc_stack.ss_sp = base + guard;
+        host_stack_context.uc_stack.ss_size = size;
+        host_stack_context.uc_link = &host_main_context;
+        makecontext(&host_stack_context, host_stack_frames, 0);
+        swapcontext(&host_main_context, &host_stack_context);
+        printf("pattern %zu: %5u bytes\n", p, unsigned(Perf::block.stack_pattern[p]));
+    }
+    printf("high water: %u of %zu bytes\n", unsigned(Stack::high_water()), size);
+
+    Stack::region_bottom = nullptr;
+    Stack::region_top = nullptr;
+    munmap(base, guard + size);
+    return 0;
+}
+
+static constexpr size_t host_bench_frames = 3000;
+
+struct HostRun {
+    double ns_per_frame;
+    uint64_t hash;
+    uint8_t frames[host_bench_frames][Leds::ledsN][3];
+};
+
+// Renders one pattern in a forked child so every run starts from the same
+// boot state. Output is captured at 8 bits per channel like the preview, the
+// hash covers the exact fixed point values. skip_hours runs the clock ahead
+// in one hour frames before capturing.
+static void host_run(size_t pattern, bool bypass, HostRun *run, uint32_t skip_hours = 0) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        host_display = false;
+        Time::step_ms = 10;
+        Interpolator::bypass = bypass;
+        while (Model::instance().Pattern() != pattern) {
+            Model::instance().IncPattern();
+        }
+        Time::step_ms = 3600 * 1000;
+        for (uint32_t h = 0; h < skip_hours; h++) {
+            HAL_SysTick_User();
+        }
+        Time::step_ms = 10;
+        double total = 0;
+        uint64_t hash = 0xcbf29ce484222325;
+        for (size_t f = 0; f < host_bench_frames; f++) {
+            auto start = std::chrono::steady_clock::now();
+            HAL_SysTick_User();
+            total += std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+            for (size_t c = 0; c < Leds::ledsN; c++) {
+                for (int32_t v : { Leds::led_buffer[c].r.raw, Leds::led_buffer[c].g.raw, Leds::led_buffer[c].b.raw }) {
+                    hash = (hash ^ uint32_t(v)) * 0x100000001b3;
+                }
+                run->frames[f][c][0] = uint8_t(std::clamp(float(Leds::led_buffer[c].r), 0.0f, 1.0f) * 255.0f);
+                run->frames[f][c][1] = uint8_t(std::clamp(float(Leds::led_buffer[c].g), 0.0f, 1.0f) * 255.0f);
+                run->frames[f][c][2] = uint8_t(std::clamp(float(Leds::led_buffer[c].b), 0.0f, 1.0f) * 255.0f);
+            }
+        }
+        run->ns_per_frame = total / host_bench_frames;
+        run->hash = hash;
+        _exit(0);
+    }
+    waitpid(pid, nullptr, 0);
+}
+
+// Per-frame cost of every pattern rendered every frame and with keyframe
+// interpolation, and the mean and largest 8-bit channel difference that
+// introduces. Patterns without keyframes must not change at all, keyframed
+// ones must stay within keyMaxDiff and keyMeanDiff.
+static int host_bench() {
+    static constexpr int32_t keyMaxDiff = 8;
+    static constexpr double keyMeanDiff = 0.25;
+
+    auto runs = static_cast<HostRun *>(mmap(nullptr, sizeof(HostRun) * 2, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0));
+    if (runs == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    int result = 0;
+    printf("pattern   full ns/frame   reduced ns/frame   mean diff   max diff\n");
+    for (size_t p = 0; p < Model::patternsN; p++) {
+        host_run(p, true, &runs[0]);
+        host_run(p, false, &runs[1]);
+        int32_t diff = 0;
+        double sum = 0;
+        for (size_t f = 0; f < host_bench_frames; f++) {
+            for (size_t c = 0; c < Leds::ledsN; c++) {
+                for (size_t i = 0; i < 3; i++) {
+                    int32_t d = std::abs(int32_t(runs[0].frames[f][c][i]) - int32_t(runs[1].frames[f][c][i]));
+                    diff = std::max(diff, d);
+                    sum += d;
+                }
+            }
+        }
+        double mean = sum / (host_bench_frames * Leds::ledsN * 3);
+        bool ok = Patterns::info[p].keyframe_ms ? diff <= keyMaxDiff && mean <= keyMeanDiff : diff == 0;
+        printf("%7zu %15.0f %18.0f %11.2f %10d %s\n", p, runs[0].ns_per_frame, runs[1].ns_per_frame, mean, int(diff), ok ? "ok" : "FAILED");
+        result |= ok ? 0 : 1;
+    }
+    munmap(runs, sizeof(HostRun) * 2);
+    return result;
+}
+
+// Output of every pattern in the all pack, hashed by host_run(), as it was
+// before the patterns moved onto shared kernels. Any change in a pattern's
+// frames shows up here.
+static constexpr uint64_t host_golden_hashes[] = {
+    0x6ac0bd4491f47905,     // Sweep
+    0xfb13f6ac686b93a5,     // HueCycle
+    0xee758a1c8f60f6a5,     // Spin
+    0x9f4bac8984be1ca5,     // Diagonal
+    0x1f3ff7a69a3fae25,     // Scroll
+    0x6f3ccc715151afa5,     // Sparkle
+    0xcceaf0916b6727a5,     // Confetti
+    0x75ca2438634817e5,     // Gradient
+    0x653bb2c0c94a5385,     // Glow
+    0xa7219722ab930a64,     // Ripple
+};
+
+static int host_golden() {
+    if (strcmp(CAPN_PACK, "all") != 0 || Model::patternsN != std::size(host_golden_hashes)) {
+        printf("golden hashes are for the all pack\n");
+        return 1;
+    }
+    auto run = static_cast<HostRun *>(mmap(nullptr, sizeof(HostRun), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0));
+    if (run == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    int result = 0;
+    for (size_t p = 0; p < Model::patternsN; p++) {
+        host_run(p, false, run);
+        bool ok = run->hash == host_golden_hashes[p];
+        printf("pattern %zu: %016llx %s\n", p, (unsigned long long)run->hash, ok ? "ok" : "FAILED");
+        result |= ok ? 0 : 1;
+    }
+    munmap(run, sizeof(HostRun));
+    return result;
+}
+
+// The oscillator patterns as they were before the bank, with the phase and
+// the hue ramp evaluated inside the per-LED loop. Only used by host_osc().
+template<typename P> static void host_inline_render(uint32_t ms, const Phase &phase) {
+    for (size_t c = 0; c < Leds::ledsN; c++) {
+        if constexpr (std::is_same_v<P, HueCycle>) {
+            fixed32<20> h = fixed32<20>(1.0f) - phase.at(ms);
+            Leds::led_buffer[c] = rgb(hsv(h, (fixed32<20>(2.00f) * Leds::radius[c]).clamp(fixed32<20>(0.0f), fixed32<20>(1.0f)), fixed32<20>(1.0f) - fixed32<20>(1.0f) * Leds::radius[c]));
+        } else if constexpr (std::is_same_v<P, Spin>) {
+            auto t = fixed32<20>(1.0f) - phase.at(ms);
+            auto h = t * fixed32<20>(6.28318530718f);
+            auto x = (Leds::x[c] - fixed32<20>(0.5f)) * cos(h) - 
+                     (Leds::y[c] - fixed32<20>(0.5f)) * sin(h);
+            auto hue((x * fixed32<20>(0.5f) + fixed32<20>(0.5f) + t * fixed32<20>(6.0f)).frac());
+            Leds::led_buffer[c] = rgb(hsv(hue, fixed32<20>(1.0f), fixed32<20>(1.0f) - fixed32<20>(0.95f) * Leds::radius[c]));
+        } else if constexpr (std::is_same_v<P, Diagonal>) {
+            auto h = (fixed32<20>(1.0f) - phase.at(ms));
+            auto hue((h + Leds::x[c] * Leds::y[c] * fixed32<20>(1.0f / 2.0f)).frac());
+            Leds::led_buffer[c] = rgb(hsv(hue, fixed32<20>(1.0f), fixed32<20>(1.0f) - fixed32<20>(0.95f) * Leds::radius[c]));
+        } else if constexpr (std::is_same_v<P, Scroll>) {
+            auto h = (fixed32<20>(1.0f) - phase.at(ms));
+            auto hue((h - Leds::x[c] * fixed32<20>(1.0f / 8.0f)).frac());
+            Leds::led_buffer[c] = rgb(hsv(hue, fixed32<20>(1.0f), fixed32<20>(1.0f) - fixed32<20>(0.95f) * Leds::radius[c]));
+        }
+    }
+}
+
+// One row of host_osc() for pattern P against phase, skipped when the pack
+// leaves P out or P has no oscillator to advance.
+template<typename P> static void host_osc_run(const char *name, Phase phase) {
+    static constexpr size_t frames = 20000;
+    constexpr size_t p = Patterns::index_of<P>();
+    if (p == Patterns::count || !Patterns::info[p].advance) {
+        printf("%-9s %21s\n", name, "not in this pack");
+        return;
+    }
+    auto capture = [](uint8_t (&out)[Leds::ledsN][3]) {
+        for (size_t c = 0; c < Leds::ledsN; c++) {
+            out[c][0] = uint8_t(std::clamp(float(Leds::led_buffer[c].r), 0.0f, 1.0f) * 255.0f);
+            out[c][1] = uint8_t(std::clamp(float(Leds::led_buffer[c].g), 0.0f, 1.0f) * 255.0f);
+            out[c][2] = uint8_t(std::clamp(float(Leds::led_buffer[c].b), 0.0f, 1.0f) * 255.0f);
+        }
+    };
+    double inline_ns = 0;
+    double osc_ns = 0;
+    int32_t diff = 0;
+    Arena::enter(p);
+    for (size_t f = 0; f < frames; f++) {
+        uint32_t ms = uint32_t(f * 10);
+        uint8_t a[Leds::ledsN][3];
+        uint8_t b[Leds::ledsN][3];
+
+        auto start = std::chrono::steady_clock::now();
+        phase.advance(ms);
+        host_inline_render<P>(ms, phase);
+        inline_ns += std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+        capture(a);
+
+        start = std::chrono::steady_clock::now();
+        Patterns::info[p].advance(ms);
+        render(p, ms);
+        osc_ns += std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+        capture(b);
+
+        for (size_t c = 0; c < Leds::ledsN; c++) {
+            for (size_t i = 0; i < 3; i++) {
+                diff = std::max(diff, std::abs(int32_t(a[c][i]) - int32_t(b[c][i])));
+            }
+        }
+    }
+    printf("%-9s %21.1f %25.1f %10d\n", name, inline_ns / (frames * Leds::ledsN), osc_ns / (frames * Leds::ledsN), int(diff));
+}
+
+// Cost per LED-frame of the oscillator patterns against the inline code they
+// replaced, and the largest 8-bit channel difference between the two.
+static int host_osc() {
+    printf("pattern   inline ns/LED-frame   oscillator ns/LED-frame   max diff\n");
+    host_osc_run<HueCycle>("HueCycle", Phase(0.02f));
+    host_osc_run<Spin>("Spin", Phase(0.08f));
+    host_osc_run<Diagonal>("Diagonal", Phase(0.02f));
+    host_osc_run<Scroll>("Scroll", Phase(0.01f));
+    return 0;
+}
+
+// Sweep and ripple bands over a generated layout of N LEDs, once testing
+// every LED and once visiting only what BandIndex and RingIndex return. True
+// when both give the same output.
+template<size_t N> static bool host_cull_run() {
+    static constexpr size_t frames = 20000;
+    static constexpr size_t anglesN = 16;
+
+    Model::pseudo_random rnd;
+    rnd.set_seed(uint32_t(N));
+    auto fixed = [](double v) {
+        fixed32<20> f;
+        f.raw = int32_t(v * 1048576.0);
+        return f;
+    };
+    static std::array<fixed32<20>, N> x;
+    static std::array<fixed32<20>, N> y;
+    static std::array<fixed32<20>, N> radius;
+    for (size_t c = 0; c < N; c++) {
+        double px = double(rnd.get() >> 8) / double(1 << 24) - 0.5;
+        double py = double(rnd.get() >> 8) / double(1 << 24) - 0.5;
+        x[c] = fixed(px);
+        y[c] = fixed(py);
+        radius[c] = fixed(sqrt(px * px + py * py) / sqrt(0.5));
+    }
+    static auto band = BandIndex<N, anglesN>::build(x, y);
+    static auto ring = RingIndex<N>::build(radius);
+
+    auto time = [](auto &&run) {
+        auto start = std::chrono::steady_clock::now();
+        int64_t sum = run();
+        return std::make_pair(std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / frames, sum);
+    };
+
+    // One sweep every 1000 frames (10s at 100Hz) at a random angle, as Sweep.
+    auto sweep_run = [&](bool indexed) {
+        int64_t sum = 0;
+        rnd.set_seed(1);
+        fixed32<20> ca;
+        fixed32<20> sa;
+        size_t k = 0;
+        for (size_t f = 0; f < frames; f++) {
+            if (f % 1000 == 0) {
+                int32_t turn = int32_t(rnd.get(0, 256));
+                auto angle = fixed32<20>(6.283185307179f/256.0f) * fixed32<20>(turn);
+                ca = cos(angle);
+                sa = sin(angle);
+                k = BandIndex<N, anglesN>::nearest(turn);
+            }
+            auto sweep = fixed32<20>(Time::seconds(uint32_t(f % 1000) * 10)) * fixed32<20>(6.0f);
+            auto lit = [&](size_t c) {
+                fixed32<20> v = sweep + (x[c] * ca - y[c] * sa);
+                if (v.abs() < fixed32<20>(1.0f)) {
+                    sum += v.raw;
+                }
+            };
+            if (indexed) {
+                band.visit(k, ca, sa, -fixed32<20>(1.0f) - sweep, fixed32<20>(1.0f) - sweep, lit);
+            } else {
+                for (size_t c = 0; c < N; c++) {
+                    lit(c);
+                }
+            }
+        }
+        return sum;
+    };
+
+    // A ring 0.1 wide expanding from the centre every 2s.
+    auto ripple_run = [&](bool indexed) {
+        int64_t sum = 0;
+        for (size_t f = 0; f < frames; f++) {
+            auto r = fixed32<20>(int32_t(f % 200)) * fixed32<20>(1.2f / 200.0f);
+            auto w = fixed32<20>(0.05f);
+            auto lit = [&](size_t c) {
+                fixed32<20> d = radius[c] - r;
+                if (d.abs() <= w) {
+                    sum += d.raw;
+                }
+            };
+            if (indexed) {
+                ring.visit(r - w, r + w, lit);
+            } else {
+                for (size_t c = 0; c < N; c++) {
+                    lit(c);
+                }
+            }
+        }
+        return sum;
+    };
+
+    auto sweep_all = time([&] { return sweep_run(false); });
+    auto sweep_index = time([&] { return sweep_run(true); });
+    auto ripple_all = time([&] { return ripple_run(false); });
+    auto ripple_index = time([&] { return ripple_run(true); });
+    bool same = sweep_all.second == sweep_index.second && ripple_all.second == ripple_index.second;
+    printf("%5zu %15.1f %17.1f %16.1f %18.1f   %s\n", N, sweep_all.first, sweep_index.first, ripple_all.first, ripple_index.first,
+        same ? "same" : "DIFFERENT");
+    return same;
+}
+
+// Every turn Sweep can pick, over 2s of sweep on the real layout. Every LED
+// inside the band must be among those SweepKernel::index visits.
+static bool host_cull_sweep() {
+    size_t missed = 0;
+    size_t checked = 0;
+    for (int32_t turn = -255; turn <= 255; turn++) {
+        auto angle = fixed32<20>(6.283185307179f/256.0f) * fixed32<20>(turn);
+        auto ca = cos(angle);
+        auto sa = sin(angle);
+        size_t k = decltype(SweepKernel::index)::nearest(turn);
+        for (uint32_t ms = 0; ms <= 2000; ms += 10) {
+            auto sweep = fixed32<20>(Time::seconds(ms)) * fixed32<20>(6.0f);
+            uint32_t visited = 0;
+            SweepKernel::index.visit(k, ca, sa, -fixed32<20>(1.0f) - sweep, fixed32<20>(1.0f) - sweep, [&](size_t c) {
+                visited |= 1u << c;
+            });
+            for (size_t c = 0; c < Leds::ledsN; c++) {
+                fixed32<20> x = sweep + (Geometry::cx[c] * ca - Geometry::cy[c] * sa);
+                if (x.abs() < fixed32<20>(1.0f)) {
+                    checked++;
+                    missed += (visited >> c) & 1 ? 0 : 1;
+                }
+            }
+        }
+    }
+    printf("sweep index on the board: %zu lit LED-frames, %zu missed\n", checked, missed);
+    return missed == 0;
+}
+
+static int host_cull() {
+    bool same = true;
+    printf("  LEDs   sweep ns/frame   indexed ns/frame   ripple ns/frame   indexed ns/frame   output\n");
+    same = host_cull_run<12>() && same;
+    same = host_cull_run<50>() && same;
+    same = host_cull_run<100>() && same;
+    same = host_cull_run<250>() && same;
+    same = host_cull_run<500>() && same;
+    same = host_cull_run<1000>() && same;
+    same = host_cull_sweep() && same;
+    return same ? 0 : 1;
+}
+
+// HueCycle's shade over a generated layout of rings rings with perRing LEDs
+// each, once per LED and once per radius class. True when both match.
+template<size_t rings, size_t perRing> static bool host_symmetry_run() {
+    static constexpr size_t N = rings * perRing;
+    static constexpr size_t frames = 2000;
+
+    static std::array<fixed32<20>, N> radius;
+    for (size_t c = 0; c < N; c++) {
+        radius[c] = fixed32<20>(int32_t(c % rings)) / fixed32<20>(int32_t(rings));
+    }
+    static auto classes = RadiusClasses<N, rings>::build(radius);
+    static rgb out[2][N];
+
+    auto run = [&](bool per_class) {
+        auto start = std::chrono::steady_clock::now();
+        for (size_t f = 0; f < frames; f++) {
+            auto h = fixed32<20>(int32_t(f)) / fixed32<20>(int32_t(frames));
+            auto shade = [&](size_t c) {
+                auto inner = (fixed32<20>(2.0f) * radius[c]).clamp(fixed32<20>(0.0f), fixed32<20>(1.0f));
+                return rgb(hsv(h, inner, fixed32<20>(1.0f) - radius[c]));
+            };
+            if (per_class) {
+                classes.scatter(out[1], shade);
+            } else {
+                for (size_t c = 0; c < N; c++) {
+                    out[0][c] = shade(c);
+                }
+            }
+        }
+        return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / frames;
+    };
+
+    double all_ns = run(false);
+    double class_ns = run(true);
+    bool same = memcmp(out[0], out[1], sizeof(out[0])) == 0;
+    printf("%5zu %8zu %15.1f %18.1f   %s\n", N, rings, all_ns, class_ns, same ? "same" : "DIFFERENT");
+    return same;
+}
+
+// Radial patterns rendered per radius class must match shading every LED,
+// on this board and on generated layouts with repeated radii.
+static int host_symmetry() {
+    auto runs = static_cast<HostRun *>(mmap(nullptr, sizeof(HostRun) * 2, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0));
+    if (runs == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    int result = 0;
+    printf("radius classes: %zu of %zu LEDs\n", layout::radiusClassesN, Leds::ledsN);
+    printf("pattern   output\n");
+    for (size_t p = 0; p < Model::patternsN; p++) {
+        if (!Patterns::info[p].radial) {
+            continue;
+        }
+        Radial::bypass = true;
+        host_run(p, false, &runs[0]);
+        Radial::bypass = false;
+        host_run(p, false, &runs[1]);
+        bool same = memcmp(runs[0].frames, runs[1].frames, sizeof(runs[0].frames)) == 0;
+        printf("%7zu   %s\n", p, same ? "same" : "DIFFERENT");
+        result |= same ? 0 : 1;
+    }
+    munmap(runs, sizeof(HostRun) * 2);
+    printf("\n  LEDs   radii   all ns/frame   class ns/frame   output\n");
+    bool same = true;
+    same = host_symmetry_run<12, 1>() && same;
+    same = host_symmetry_run<12, 2>() && same;
+    same = host_symmetry_run<25, 4>() && same;
+    same = host_symmetry_run<50, 10>() && same;
+    return result | (same ? 0 : 1);
+}
+
+// Frame to frame smoothness right after boot and after 1000 hours of uptime,
+// both should show the same small steps if the phases wrap cleanly. Fails when
+// the 1000 hour run steps further than the boot run.
+static int host_longrun() {
+    auto runs = static_cast<HostRun *>(mmap(nullptr, sizeof(HostRun) * 2, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0));
+    if (runs == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    auto step = [](const HostRun &run, int32_t &max) {
+        double sum = 0;
+        max = 0;
+        for (size_t f = 1; f < host_bench_frames; f++) {
+            for (size_t c = 0; c < Leds::ledsN; c++) {
+                for (size_t i = 0; i < 3; i++) {
+                    int32_t d = std::abs(int32_t(run.frames[f][c][i]) - int32_t(run.frames[f - 1][c][i]));
+                    max = std::max(max, d);
+                    sum += d;
+                }
+            }
+        }
+        return sum / ((host_bench_frames - 1) * Leds::ledsN * 3);
+    };
+    int result = 0;
+    printf("pattern   boot mean step   boot max step   1000h mean step   1000h max step\n");
+    for (size_t p = 0; p < Model::patternsN; p++) {
+        host_run(p, false, &runs[0]);
+        host_run(p, false, &runs[1], 1000);
+        int32_t boot_max = 0;
+        int32_t late_max = 0;
+        double boot_mean = step(runs[0], boot_max);
+        double late_mean = step(runs[1], late_max);
+        // The mean may move by a few rounding steps at another phase. Animated
+        // patterns without keyframes draw from the RNG, which runs a
+        // different sequence after 1000h, so they get more slack.
+        auto &info = Patterns::info[p];
+        bool random = info.animated && info.keyframe_ms == 0;
+        bool smooth = late_mean <= boot_mean * (random ? 1.25 : 1.01) && late_max <= boot_max + (random ? 16 : 0);
+        printf("%7zu %16.2f %15d %17.2f %16d %s\n", p, boot_mean, int(boot_max), late_mean, int(late_max), smooth ? "ok" : "FAILED");
+        result |= smooth ? 0 : 1;
+    }
+    munmap(runs, sizeof(HostRun) * 2);
+    return result;
+}
+
+// Boots, runs skip frames of pattern, snapshots through Persist::flush() and
+// captures what follows. With resume set it boots from the EEPROM in eeprom
+// instead and captures the first frames. Either way eeprom holds the EEPROM
+// afterwards.
+static void host_resume_run(size_t pattern, uint32_t skip, bool resume, uint32_t *eeprom, HostRun *run) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        host_display = false;
+        Time::step_ms = 10;
+        if (resume) {
+            memcpy(Eeprom::data, eeprom, sizeof(Eeprom::data));
+        } else {
+            while (Model::instance().Pattern() != pattern) {
+                Model::instance().IncPattern();
+            }
+            for (uint32_t f = 0; f < skip; f++) {
+                HAL_SysTick_User();
+            }
+            Persist::instance().flush();
+        }
+        for (size_t f = 0; f < host_bench_frames; f++) {
+            HAL_SysTick_User();
+            for (size_t c = 0; c < Leds::ledsN; c++) {
+                run->frames[f][c][0] = uint8_t(std::clamp(float(Leds::led_buffer[c].r), 0.0f, 1.0f) * 255.0f);
+                run->frames[f][c][1] = uint8_t(std::clamp(float(Leds::led_buffer[c].g), 0.0f, 1.0f) * 255.0f);
+                run->frames[f][c][2] = uint8_t(std::clamp(float(Leds::led_buffer[c].b), 0.0f, 1.0f) * 255.0f);
+            }
+        }
+        memcpy(eeprom, Eeprom::data, sizeof(Eeprom::data));
+        _exit(0);
+    }
+    waitpid(pid, nullptr, 0);
+}
+
+// Every pattern snapshotted after a minute, then booted again from that
+// EEPROM. Patterns whose motion lives in the phase and the RNG must carry on
+// exactly where the first run went on, instead of replaying from boot.
+static int host_resume() {
+    auto runs = static_cast<HostRun *>(mmap(nullptr, sizeof(HostRun) * 3 + sizeof(Eeprom::data), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0));
+    if (runs == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    auto eeprom = reinterpret_cast<uint32_t *>(&runs[3]);
+    auto diff = [](const HostRun &a, const HostRun &b) {
+        int32_t max = 0;
+        for (size_t f = 0; f < host_bench_frames; f++) {
+            for (size_t c = 0; c < Leds::ledsN; c++) {
+                for (size_t i = 0; i < 3; i++) {
+                    max = std::max(max, std::abs(int32_t(a.frames[f][c][i]) - int32_t(b.frames[f][c][i])));
+                }
+            }
+        }
+        return max;
+    };
+    int result = 0;
+    printf("pattern   max diff resumed   max diff cold boot\n");
+    for (size_t p = 0; p < Model::patternsN; p++) {
+        host_resume_run(p, 6000, false, eeprom, &runs[0]);
+        host_resume_run(p, 0, true, eeprom, &runs[1]);
+        memset(eeprom, 0, sizeof(Eeprom::data));
+        host_resume_run(p, 0, false, eeprom, &runs[2]);
+        int32_t resumed = diff(runs[0], runs[1]);
+        printf("%7zu %18d %20d\n", p, int(resumed), int(diff(runs[0], runs[2])));
+        if (Patterns::info[p].osc && resumed != 0) {
+            result = 1;
+        }
+    }
+    munmap(runs, sizeof(HostRun) * 3 + sizeof(Eeprom::data));
+    return result;
+}
+#endif  // #ifndef WIN32
+
+// Saves through the settings log on the emulated EEPROM. Every save must load
+// back, writes must spread over the whole area, the boot scan must stay
+// bounded, and a save cut short at any write must load either the new or the
+// previous settings. Booting from any contents must stay bounded too.
+static int host_eeprom() {
+    using Log = Model::SettingsLog;
+    using Words = uint32_t[Settings::wordsN];
+    static constexpr uint32_t saves = 100000;
+
+    auto fill = [](Words &words, uint32_t seed) {
+        for (size_t c = 0; c < Settings::wordsN; c++) {
+            words[c] = (seed + uint32_t(c)) * 2654435761u;
+        }
+    };
+
+    auto erase = [] {
+        memset(Eeprom::data, 0, sizeof(Eeprom::data));
+        memset(Eeprom::wear, 0, sizeof(Eeprom::wear));
+        Eeprom::write_budget = ~uint32_t(0);
+    };
+
+    int result = 0;
+    erase();
+    uint32_t max_reads = 0;
+    for (uint32_t c = 0; c < saves; c++) {
+        Words in;
+        fill(in, c);
+        Log::save(in);
+        Words out = { };
+        Eeprom::reads = 0;
+        if (!Log::load(out) || memcmp(in, out, sizeof(in)) != 0) {
+            printf("save %u did not load back\n", unsigned(c));
+            result = 1;
+            break;
+        }
+        max_reads = std::max(max_reads, Eeprom::reads);
+    }
+    auto used = std::begin(Eeprom::wear) + Log::slotsN * Log::recordN;
+    uint32_t least = *std::min_element(std::begin(Eeprom::wear), used);
+    uint32_t most = *std::max_element(std::begin(Eeprom::wear), used);
+    printf("%u saves over %zu slots of %zu words\n", unsigned(saves), Log::slotsN, Log::recordN);
+    printf("writes per word: min %u max %u, one word rewritten in place: %u\n", unsigned(least), unsigned(most), unsigned(saves));
+    printf("boot scan: at most %u word reads\n", unsigned(max_reads));
+
+    // Power loss after every possible number of writes into a save, at the
+    // start of the log, in the middle and across the wrap.
+    uint32_t torn = 0;
+    for (uint32_t before : { 0u, 1u, 40u, uint32_t(Log::slotsN - 1), uint32_t(Log::slotsN * 3 + 7) }) {
+        for (uint32_t budget = 0; budget <= Log::recordN; budget++) {
+            erase();
+            Words in;
+            for (uint32_t c = 0; c < before; c++) {
+                fill(in, c + 1000);
+                Log::save(in);
+            }
+            Words previous;
+            memcpy(previous, in, sizeof(in));
+            fill(in, 7);
+            Eeprom::write_budget = budget;
+            Log::save(in);
+            Eeprom::write_budget = ~uint32_t(0);
+            Words out = { };
+            bool loaded = Log::load(out);
+            bool ok = budget == Log::recordN ? loaded && memcmp(out, in, sizeof(in)) == 0 :
+                      before == 0 ? !loaded : loaded && memcmp(out, previous, sizeof(in)) == 0;
+            if (!ok) {
+                printf("power loss after %u writes with %u saves before: wrong settings\n", unsigned(budget), unsigned(before));
+                result = 1;
+            }
+            torn++;
+        }
+    }
+    printf("power loss: %u cases %s\n", unsigned(torn), result ? "FAILED" : "ok");
+
+    // A word the controller fails to program fails the save, the previous
+    // settings stay and saving again takes the same slot.
+    erase();
+    Words previous;
+    fill(previous, 1);
+    Log::save(previous);
+    Words in;
+    fill(in, 2);
+    Eeprom::rejects = 1;
+    bool reported = !Log::save(in);
+    Words out = { };
+    bool kept = Log::load(out) && memcmp(out, previous, sizeof(out)) == 0;
+    size_t slot = Log::newest();
+    bool retried = Log::save(in) && Log::load(out) && memcmp(out, in, sizeof(out)) == 0 && Log::newest() == slot + 1;
+    bool rejected = reported && kept && retried;
+    printf("rejected write: %s\n", rejected ? "ok" : "FAILED");
+    result |= rejected ? 0 : 1;
+
+    // Booting from random contents and from logs of the older record sizes
+    // must read each log at most once around, whatever the headers say.
+    static constexpr size_t bootReads = Log::maxReads + Model::SettingsLogV2::maxReads + Model::SettingsLogV1::maxReads + 1;
+    uint32_t boot_reads = 0;
+    Model model;
+    for (uint32_t image = 0; image < 1002; image++) {
+        erase();
+        if (image < 1000) {
+            uint32_t x = image * 2654435761u + 1;
+            for (size_t c = 0; c < Eeprom::wordsN; c++) {
+                x ^= x << 13;
+                x ^= x >> 17;
+                x ^= x << 5;
+                Eeprom::data[c] = x;
+            }
+        } else if (image == 1000) {
+            for (uint32_t c = 0; c < 70; c++) {
+                const uint32_t v1[1] = { c };
+                Model::SettingsLogV1::save(v1);
+            }
+        } else {
+            for (uint32_t c = 0; c < 30; c++) {
+                const uint32_t v2[4] = { 2, c, c * 3, c * 7 };
+                Model::SettingsLogV2::save(v2);
+            }
+        }
+        Eeprom::reads = 0;
+        model.load();
+        boot_reads = std::max(boot_reads, Eeprom::reads);
+    }
+    bool bounded = boot_reads <= bootReads;
+    printf("boot from random and older images: at most %u word reads, limit %zu %s\n", unsigned(boot_reads), bootReads, bounded ? "ok" : "FAILED");
+    result |= bounded ? 0 : 1;
+    return result;
+}
+
+// Settings through blank, corrupted and older EEPROM contents. Every case
+// must load valid settings, and the newest intact ones where there are any.
+static int host_settings() {
+    int result = 0;
+    auto erase = [] {
+        memset(Eeprom::data, 0, sizeof(Eeprom::data));
+    };
+    auto check = [&result](const char *name, bool ok) {
+        printf("%-48s %s\n", name, ok ? "ok" : "FAILED");
+        result |= ok ? 0 : 1;
+    };
+    auto same = [](const Settings &a, const Settings &b) {
+        return memcmp(&a, &b, sizeof(Settings)) == 0;
+    };
+    Settings custom;
+    custom.pattern = 3;
+    custom.brightness = 128;
+    custom.speed = 24;
+    for (size_t c = 0; c < Leds::ledsN; c++) {
+        custom.calibration[c] = uint8_t(200 + c);
+    }
+
+    Model model;
+    erase();
+    model.load();
+    check("blank EEPROM loads defaults", same(model.settings, Settings()));
+
+    model.settings = custom;
+    model.save();
+    model.settings = Settings();
+    model.load();
+    check("saved settings load back", same(model.settings, custom));
+
+    // Flip every bit of the newest record, the one before must win.
+    bool flips = true;
+    Settings older = custom;
+    older.pattern = uint8_t(5 % Model::patternsN);
+    for (size_t bit = 0; bit < Model::SettingsLog::recordN * 32; bit++) {
+        erase();
+        model.settings = older;
+        model.save();
+        model.settings = custom;
+        model.save();
+        size_t newest = Model::SettingsLog::newest() * Model::SettingsLog::recordN;
+        Eeprom::data[newest + bit / 32] ^= 1u << (bit % 32);
+        model.load();
+        flips = flips && same(model.settings, older);
+    }
+    check("any single bit flip falls back to the previous", flips);
+
+    erase();
+    for (size_t c = 0; c < Eeprom::wordsN; c++) {
+        Eeprom::data[c] = uint32_t(c) * 2654435761u;
+    }
+    model.load();
+    check("random EEPROM loads defaults", same(model.settings, Settings()));
+
+    erase();
+    Settings future = custom;
+    future.version = Settings::currentVersion + 1;
+    uint32_t words[Settings::wordsN];
+    future.pack(words);
+    Model::SettingsLog::save(words);
+    model.load();
+    check("unknown version loads defaults", same(model.settings, Settings()));
+
+    erase();
+    Settings wild = custom;
+    wild.pattern = 200;
+    wild.speed = 0;
+    wild.pack(words);
+    Model::SettingsLog::save(words);
+    model.load();
+    Settings tamed = custom;
+    tamed.pattern = Settings().pattern;
+    tamed.speed = Settings().speed;
+    check("out of range fields get their defaults", same(model.settings, tamed));
+
+    erase();
+    Eeprom::data[0] = 6 % Model::patternsN;
+    model.load();
+    Settings v0;
+    v0.pattern = uint8_t(6 % Model::patternsN);
+    check("version 0 raw word migrates", same(model.settings, v0));
+
+    erase();
+    uint32_t v2[4];
+    custom.pack(words);
+    memcpy(v2, words, sizeof(v2));
+    reinterpret_cast<uint8_t *>(v2)[0] = 2;
+    Model::SettingsLogV2::save(v2);
+    model.load();
+    check("version 2 log migrates", same(model.settings, custom));
+
+    erase();
+    for (uint32_t c = 0; c < 70; c++) {
+        const uint32_t v1[1] = { uint32_t(c % Model::patternsN) };
+        Model::SettingsLogV1::save(v1);
+    }
+    model.load();
+    Settings migrated;
+    migrated.pattern = uint8_t(69 % Model::patternsN);
+    check("version 1 log migrates", same(model.settings, migrated));
+    model.settings.brightness = 99;
+    model.save();
+    model.settings = Settings();
+    model.load();
+    migrated.brightness = 99;
+    check("migrated settings save in the current layout", same(model.settings, migrated));
+    return result;
+}
+
+// One Queue<T, N> between a producer and a consumer thread spinning on it.
+// The producer either retries until an item fits or drops it when full, the
+// consumer checks each item arrives whole and in order and that nothing is
+// lost except what the producer counted as dropped.
+template<size_t N> static bool host_spsc_run(bool retry, uint32_t itemsN) {
+    struct Item {
+        uint32_t seq;
+        uint32_t check[3];
+    };
+    auto check = [](const Item &item) {
+        return item.check[0] == item.seq * 2654435761u && item.check[1] == ~item.seq &&
+            item.check[2] == (item.seq ^ 0x5A5A5A5Au);
+    };
+
+    Queue<Item, N> queue;
+    std::atomic<bool> finished { false };
+    bool ok = true;
+    uint32_t received = 0;
+    auto start = std::chrono::steady_clock::now();
+    std::thread consumer([&] {
+        uint32_t next = 0;
+        for (;;) {
+            Item item;
+            if (queue.pop(item)) {
+                if (!check(item) || item.seq < next || (retry && item.seq != next)) {
+                    ok = false;
+                }
+                next = item.seq + 1;
+                received++;
+            } else if (finished.load(std::memory_order_acquire) && queue.empty()) {
+                break;
+            } else {
+                std::this_thread::yield();
+            }
+        }
+    });
+    uint32_t failed = 0;
+    for (uint32_t seq = 0; seq < itemsN; seq++) {
+        Item item = { seq, { seq * 2654435761u, ~seq, seq ^ 0x5A5A5A5Au } };
+        while (!queue.push(item)) {
+            failed++;
+            std::this_thread::yield();
+            if (!retry) {
+                break;
+            }
+        }
+    }
+    finished.store(true, std::memory_order_release);
+    consumer.join();
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+
+    uint32_t lost = retry ? 0 : failed;
+    ok = ok && queue.dropped == failed && received + lost == itemsN;
+    printf("%5zu   %-6s %9u %9u %9u %8.1f   %s\n", N, retry ? "retry" : "drop", unsigned(itemsN),
+        unsigned(received), unsigned(lost), double(ns) / itemsN, ok ? "ok" : "FAILED");
+    return ok;
+}
+
+static int host_spsc() {
+    static constexpr uint32_t itemsN = 1000000;
+    printf(" size   mode        sent  received   dropped  ns/item\n");
+    bool ok = true;
+    for (bool retry : { true, false }) {
+        ok = host_spsc_run<2>(retry, itemsN) && ok;
+        ok = host_spsc_run<4>(retry, itemsN) && ok;
+        ok = host_spsc_run<8>(retry, itemsN) && ok;
+        ok = host_spsc_run<64>(retry, itemsN) && ok;
+    }
+    return ok ? 0 : 1;
+}
+
+// Button edge sequences with bounce noise, fed in between 100Hz polls that
+// see the previous frame's time as SysTick does. Checks the events and their
+// timestamps, and what the model does with them.
+static int host_button() {
+    struct Edge {
+        uint32_t ms;
+        bool pressed;
+    };
+    struct Case {
+        const char *name;
+        std::vector<Edge> edges;
+        std::vector<Button::Event> events;
+        int patterns;
+        uint8_t brightness;
+        uint8_t speed;
+    };
+    using enum Button::Type;
+    const Case cases[] = {
+        { "clean click", { { 100, true }, { 300, false } },
+            { { Press, 100 }, { Release, 300 } }, 1, 255, 16 },
+        { "bouncy click", { { 100, true }, { 102, false }, { 104, true }, { 107, false }, { 111, true },
+                            { 300, false }, { 303, true }, { 305, false } },
+            { { Press, 111 }, { Release, 305 } }, 1, 255, 16 },
+        { "5 ms glitch", { { 100, true }, { 105, false } },
+            { }, 0, 255, 16 },
+        { "bounce longer than the debounce", { { 100, true }, { 125, false }, { 127, true }, { 300, false } },
+            { { Press, 127 }, { Release, 300 } }, 1, 255, 16 },
+        { "long press", { { 100, true }, { 1500, false } },
+            { { Press, 100 }, { LongPress, 900 }, { Release, 1500 } }, 0, 128, 16 },
+        { "two long presses", { { 100, true }, { 1000, false }, { 1100, true }, { 2000, false } },
+            { { Press, 100 }, { LongPress, 900 }, { Release, 1000 }, { Press, 1100 }, { LongPress, 1900 }, { Release, 2000 } },
+            0, 64, 16 },
+        { "double press", { { 100, true }, { 200, false }, { 350, true }, { 450, false } },
+            { { Press, 100 }, { Release, 200 }, { Press, 350 }, { DoublePress, 350 }, { Release, 450 } }, 0, 255, 32 },
+        { "bouncy double press", { { 100, true }, { 103, false }, { 106, true }, { 200, false }, { 201, true }, { 204, false },
+                                   { 350, true }, { 352, false }, { 355, true }, { 450, false } },
+            { { Press, 106 }, { Release, 204 }, { Press, 355 }, { DoublePress, 355 }, { Release, 450 } }, 0, 255, 32 },
+        { "triple press", { { 100, true }, { 200, false }, { 350, true }, { 450, false }, { 600, true }, { 700, false } },
+            { { Press, 100 }, { Release, 200 }, { Press, 350 }, { DoublePress, 350 }, { Release, 450 },
+              { Press, 600 }, { Release, 700 } }, 1, 255, 32 },
+        { "clicks too far apart", { { 100, true }, { 200, false }, { 600, true }, { 700, false } },
+            { { Press, 100 }, { Release, 200 }, { Press, 600 }, { Release, 700 } }, 2, 255, 16 },
+        { "click right after a long press", { { 100, true }, { 1000, false }, { 1100, true }, { 1200, false } },
+            { { Press, 100 }, { LongPress, 900 }, { Release, 1000 }, { Press, 1100 }, { Release, 1200 } }, 1, 128, 16 },
+    };
+
+    int result = 0;
+    for (auto &test : cases) {
+        Button button;
+        Model model;
+        model.settings = Settings();
+        std::vector<Button::Event> events;
+        size_t next = 0;
+        for (uint32_t ms = 0; ms < 3000; ms += 10) {
+            for (; next < test.edges.size() && test.edges[next].ms < ms; next++) {
+                button.edge(test.edges[next].pressed, test.edges[next].ms);
+            }
+            button.poll(ms - 10);
+            for (Button::Event event; button.pop(event); ) {
+                events.push_back(event);
+                model.button(event);
+            }
+        }
+        bool ok = events.size() == test.events.size();
+        for (size_t c = 0; ok && c < events.size(); c++) {
+            ok = events[c].type == test.events[c].type && events[c].ms == test.events[c].ms;
+        }
+        ok = ok && model.Pattern() == size_t(test.patterns) &&
+            model.settings.brightness == test.brightness && model.settings.speed == test.speed;
+        printf("%-36s %s\n", test.name, ok ? "ok" : "FAILED");
+        if (!ok) {
+            const char *names[] = { "press", "release", "long", "double" };
+            for (auto &e : events) {
+                printf("    %-8s %5u\n", names[e.type], unsigned(e.ms));
+            }
+            printf("    pattern %zu brightness %u speed %u\n", model.Pattern(), unsigned(model.settings.brightness), unsigned(model.settings.speed));
+            result = 1;
+        }
+    }
+    return result;
+}
+
+// Rapid button presses at 100Hz, with settings saved inside SysTick as before
+// and deferred to the main loop, also with a word that fails to program.
+// Counts records written and frames dropped waiting for EEPROM programming,
+// and checks the settings that load back.
+static int host_persist() {
+    static constexpr uint32_t presses = 10;
+    static constexpr uint32_t press_ms = Button::doubleMs + 100;
+    static constexpr uint32_t run_ms = 12000;
+
+    host_display = false;
+    Time::step_ms = 10;
+    int result = 0;
+    printf("mode        presses   records   frames dropped   loads back\n");
+    for (const char *mode : { "systick", "deferred", "rejected" }) {
+        bool immediate = strcmp(mode, "systick") == 0;
+        memset(Eeprom::data, 0, sizeof(Eeprom::data));
+        memset(Eeprom::wear, 0, sizeof(Eeprom::wear));
+        // The first word of the first save fails, the save comes again.
+        Eeprom::rejects = strcmp(mode, "rejected") == 0 ? 1 : 0;
+        Persist::immediate = immediate;
+        Perf::block.frames_dropped = 0;
+        for (uint32_t ms = 0; ms < run_ms; ms += Time::step_ms) {
+            Eeprom::clock_us = ms * 1000;
+            if (ms / press_ms < presses && ms % press_ms <= 50 && ms % press_ms % 50 == 0) {
+                Button::instance().edge(ms % press_ms == 0, Time::instance().real_ms());
+            }
+            HAL_SysTick_User();
+            Persist_Service();
+        }
+        uint32_t writes = 0;
+        for (auto w : Eeprom::wear) {
+            writes += w;
+        }
+        uint32_t words[Settings::wordsN] = { };
+        Settings loaded;
+        bool loads = Model::SettingsLog::load(words) && Persist::instance().idle();
+        loaded.unpack(words);
+        loads = loads && loaded.pattern == Model::instance().Pattern();
+        printf("%-10s %8u %9u %16u   %s\n", mode, unsigned(presses),
+            unsigned(writes / Model::SettingsLog::recordN), unsigned(Perf::block.frames_dropped), loads ? "yes" : "NO");
+        if (!loads || (!immediate && Perf::block.frames_dropped != 0)) {
+            result = 1;
+        }
+    }
+    Persist::immediate = false;
+    return result;
+}
+
+// The register drivers against the mock register file: what each call
+// writes and in which order, and how many register accesses it costs.
+static int host_drivers() {
+    using namespace drivers;
+    auto &r = mock::registers;
+    auto &log = mock::log;
+    int result = 0;
+    auto check = [&result](const char *name, bool ok) {
+        printf("%-56s %s\n", name, ok ? "ok" : "FAILED");
+        result |= ok ? 0 : 1;
+    };
+    auto wrote = [&log](size_t n, const mock::Reg &reg, uint32_t value) {
+        return n < log.reads + log.writes && log.entries[n].write &&
+            log.entries[n].reg == &reg && log.entries[n].value == value;
+    };
+    struct Cost {
+        const char *name;
+        uint32_t reads;
+        uint32_t writes;
+    };
+    Cost costs[7];
+    size_t costsN = 0;
+    auto cost = [&](const char *name) {
+        costs[costsN++] = { name, log.reads, log.writes };
+    };
+
+    // Channel set up by HAL_DMA_Init (memory to peripheral, memory
+    // increment), still enabled from the previous frame.
+    static const uint8_t frame[16] = { };
+    constexpr uint32_t setup = (1u << 4) | (1u << 7);
+    r.dma1_channel3.CCR.value = setup | DMA_CCR_EN | DMA_CCR_TCIE;
+    log.clear();
+    SpiDma::start(frame, sizeof(frame));
+    cost("SpiDma::start");
+    check("start disables the channel before reprogramming it",
+        log.entries[0].reg == &r.dma1_channel3.CCR && wrote(1, r.dma1_channel3.CCR, setup | DMA_CCR_TCIE));
+    check("start clears the channel flags", wrote(2, r.dma1.IFCR, DMA_IFCR_CGIF3));
+    check("start points the channel at the frame and SPI1 DR",
+        r.dma1_channel3.CNDTR.value == sizeof(frame) &&
+        r.dma1_channel3.CMAR.value == uint32_t(reinterpret_cast<uintptr_t>(frame)) &&
+        r.dma1_channel3.CPAR.value == uint32_t(reinterpret_cast<uintptr_t>(&r.spi1.DR)));
+    check("start keeps the channel setup and enables it with TCIE",
+        r.dma1_channel3.CCR.value == (setup | DMA_CCR_TCIE | DMA_CCR_EN));
+    check("start enables SPI1 and its TX DMA request",
+        (r.spi1.CR2.value & SPI_CR2_TXDMAEN) && (r.spi1.CR1.value & SPI_CR1_SPE));
+
+    r.dma1.ISR.value = DMA_ISR_TCIF3;
+    log.clear();
+    bool complete = SpiDma::irq();
+    cost("SpiDma::irq");
+    check("DMA interrupt reports transfer complete and clears it", complete && wrote(1, r.dma1.IFCR, DMA_IFCR_CGIF3));
+    r.dma1.ISR.value = 0;
+    check("DMA interrupt without TCIF3 reports nothing", !SpiDma::irq());
+
+    bool pressed = false;
+    r.exti.PR.value = EXTI_PR_PIF1;
+    r.gpiob.IDR.value = 0;
+    log.clear();
+    bool fired = ButtonLine::irq(pressed);
+    cost("ButtonLine::irq");
+    check("EXTI line 1 low reads as pressed and is acknowledged", fired && pressed && wrote(1, r.exti.PR, EXTI_PR_PIF1));
+    r.gpiob.IDR.value = GPIO_IDR_ID1;
+    check("EXTI line 1 high reads as released", ButtonLine::irq(pressed) && !pressed);
+    r.exti.PR.value = 1u << 0;
+    log.clear();
+    check("EXTI line 0 is left alone", !ButtonLine::irq(pressed) && log.writes == 0);
+
+    r.flash.PECR.value = FLASH_PECR_PELOCK;
+    log.clear();
+    DataEeprom::unlock();
+    cost("DataEeprom::unlock");
+    check("unlock writes both keys in order", wrote(1, r.flash.PEKEYR, 0x89ABCDEF) && wrote(2, r.flash.PEKEYR, 0x02030405));
+    r.flash.PECR.value = 0;
+    log.clear();
+    DataEeprom::unlock();
+    check("unlock when unlocked writes nothing", log.writes == 0);
+
+    r.flash.SR.value = 0;
+    log.clear();
+    bool programmed = DataEeprom::program(5, 0xC0FFEE);
+    cost("DataEeprom::program");
+    check("program writes the word", programmed && r.eeprom[5].value == 0xC0FFEE);
+    r.flash.SR.value = FLASH_SR_PGAERR;
+    check("program reports and clears an error", !DataEeprom::program(6, 1) && wrote(log.reads + log.writes - 1, r.flash.SR, FLASH_SR_PGAERR));
+
+    log.clear();
+    DataEeprom::lock();
+    cost("DataEeprom::lock");
+    check("lock sets PELOCK", (r.flash.PECR.value & FLASH_PECR_PELOCK) != 0);
+
+    // 8MHz with 100 ticks a second, HAL's tick at 120ms.
+    uint32_t tick = 120;
+    r.systick.LOAD.value = 79999;
+    r.systick.VAL.value = 79999;
+    r.scb.ICSR.value = 0;
+    log.clear();
+    uint32_t start_ms = SysTickClock::ms(tick, 10);
+    cost("SysTickClock::ms");
+    check("clock reads the tick right after SysTick fired", start_ms == 120);
+    r.systick.VAL.value = 39999;
+    check("clock counts halfway through a period as 5ms", SysTickClock::ms(tick, 10) == 125);
+    r.systick.VAL.value = 0;
+    uint32_t last_ms = SysTickClock::ms(tick, 10);
+    r.systick.VAL.value = 79999;
+    r.scb.ICSR.value = SCB_ICSR_PENDSTSET_Msk;
+    check("clock counts a wrap SysTick has not handled yet", last_ms == 129 && SysTickClock::ms(tick, 10) == 130);
+    r.scb.ICSR.value = 0;
+
+    // Through the IRQ entry points into the button and the LED queue.
+    Time::step_ms = 10;
+    Time::instance().advance();
+    r.exti.PR.value = EXTI_PR_PIF1;
+    r.gpiob.IDR.value = 0;
+    Button_ExtiIrq();
+    Button::instance().poll(Time::instance().real_ms() + Button::debounceMs);
+    Button::Event event;
+    check("EXTI interrupt reaches the button as a press", Button::instance().pop(event) && event.type == Button::Press);
+    r.dma1.ISR.value = DMA_ISR_TCIF3;
+    uint32_t done_ms = 0;
+    Leds_DmaIrq();
+    check("DMA interrupt reaches the LED completion queue", Leds::completed.pop(done_ms));
+
+    printf("\nregister accesses per call:\n");
+    for (size_t c = 0; c < costsN; c++) {
+        printf("  %-22s %2u reads %2u writes\n", costs[c].name, unsigned(costs[c].reads), unsigned(costs[c].writes));
+    }
+    return result;
+}
+
+// Boot timeline on the target, the old sequence against the current one.
+// Step costs are estimates in microseconds at 8 MHz and run 3.8 times slower
+// on the MSI clock before SystemClock_Config(). The frame cost is swept
+// because it depends on the pattern. SysTick preempts main whenever a tick is
+// due and ticks that pass during a long handler collapse into one, as on the
+// chip. A frame only shows once its DMA finishes before the next frame
+// restarts it. Also boots the real code from saved settings and checks the
+// first frame is the restored pattern.
+static int host_boot() {
+    static constexpr double msiScale = 8.0 / 2.097;
+    static constexpr double paintUs = 200;
+    static constexpr double halInitUs = 30;
+    static constexpr double clockUs = 40;
+    static constexpr double peripheralsUs = 20;
+    static constexpr double gatingUs = 5;
+    static constexpr double sendUs = (Leds::ledsN * sizeof(uint16_t) * 3 * 4 + Leds::spiPaddingBytes) * 8 / 4.0;
+    static constexpr double endUs = 3e6;
+
+    struct Sim {
+        double frame_us;
+        double t = 0;
+        double scale = msiScale;
+        double period = 0;
+        double next_tick = 0;
+        uint32_t ticks_ms = 0;
+        uint32_t tick_ms = 1;
+        bool frames = false;
+        bool spi = false;
+        double sent = -1;
+        double shown = -1;
+        double dma_start = -1;
+
+        void frame() {
+            t += frame_us * scale;
+            if (!spi) {
+                return;
+            }
+            if (shown < 0 && dma_start >= 0 && t - dma_start >= sendUs) {
+                shown = dma_start + sendUs;
+            }
+            dma_start = t;
+            if (sent < 0) {
+                sent = t;
+            }
+        }
+
+        void interrupt() {
+            ticks_ms += tick_ms;
+            if (frames) {
+                frame();
+            }
+            next_tick = std::max(next_tick + period, t);
+        }
+
+        // Main context work, with SysTick preempting it.
+        void work(double us) {
+            double left = us * scale;
+            while (period != 0 && next_tick <= t + left && t < endUs) {
+                left -= next_tick - t;
+                t = next_tick;
+                interrupt();
+            }
+            t += left;
+        }
+
+        void delay(uint32_t ms) {
+            uint32_t start = ticks_ms;
+            while (ticks_ms - start < ms + tick_ms && t < endUs) {
+                t = std::max(t, next_tick);
+                interrupt();
+            }
+        }
+
+        void start_tick(uint32_t ms) {
+            tick_ms = ms;
+            period = ms * 1000.0;
+            next_tick = t + period;
+        }
+
+        // Main idles in WFI until the first frame has shown.
+        void settle() {
+            while (shown < 0 && t < endUs) {
+                t = std::max(t, next_tick);
+                interrupt();
+            }
+        }
+    };
+
+    auto old_boot = [](Sim &sim) {
+        sim.work(paintUs);
+        sim.work(halInitUs);
+        sim.start_tick(1);
+        sim.frames = true;
+        sim.work(clockUs);
+        sim.scale = 1;
+        sim.start_tick(1);
+        sim.work(peripheralsUs);
+        sim.spi = true;
+        sim.delay(500);
+        sim.work(gatingUs);
+        sim.start_tick(10);
+    };
+
+    auto new_boot = [](Sim &sim) {
+        sim.work(paintUs);
+        sim.work(halInitUs);
+        sim.start_tick(10);
+        sim.work(clockUs);
+        sim.scale = 1;
+        sim.start_tick(10);
+        sim.work(peripheralsUs);
+        sim.spi = true;
+        sim.work(0);
+        sim.frame();
+        sim.frames = true;
+        sim.work(gatingUs);
+    };
+
+    auto ms = [](double us) {
+        static char text[16];
+        if (us < 0 || us >= endUs) {
+            return "never";
+        }
+        snprintf(text, sizeof(text), "%.1f", us / 1000);
+        return static_cast<const char *>(text);
+    };
+
+    int result = 0;
+    printf("frame ms   sequence   first sent ms   first shown ms   main loop ms\n");
+    for (double frame_us : { 100.0, 250.0, 1000.0, 3000.0 }) {
+        for (bool fast : { false, true }) {
+            Sim sim { frame_us };
+            fast ? new_boot(sim) : old_boot(sim);
+            double main_us = sim.t;
+            sim.settle();
+            printf("%8.2f   %-8s %15s", frame_us / 1000, fast ? "fast" : "old", ms(sim.sent));
+            printf(" %16s", ms(sim.shown));
+            printf(" %14s\n", ms(main_us));
+            if (fast && !(sim.shown >= 0 && sim.shown < 10000)) {
+                result = 1;
+            }
+        }
+    }
+
+    // The real first frame, from settings saved before the reset.
+    host_display = false;
+    memset(Eeprom::data, 0, sizeof(Eeprom::data));
+    Settings saved;
+    saved.pattern = uint8_t(5 % Model::patternsN);
+    uint32_t words[Settings::wordsN];
+    saved.pack(words);
+    Model::SettingsLog::save(words);
+    Boot::running = false;
+    HAL_SysTick_User();
+    bool gated = Leds::completed.empty() && Time::instance().real_ms() == 0;
+    Boot_FirstFrame();
+    bool lit = false;
+    for (size_t c = 0; c < Leds::ledsN; c++) {
+        lit = lit || Leds::led_buffer[c].r.raw || Leds::led_buffer[c].g.raw || Leds::led_buffer[c].b.raw;
+    }
+    bool restored = Model::instance().Pattern() == saved.pattern && Arena::current() == saved.pattern;
+    bool sent = !Leds::completed.empty();
+    printf("\nSysTick before boot leaves frames alone: %s\n", gated ? "ok" : "FAILED");
+    printf("first frame is the restored pattern and is sent: %s\n", restored && sent && lit ? "ok" : "FAILED");
+    if (!gated || !restored || !sent || !lit) {
+        result = 1;
+    }
+    return result;
+}
+
+int main(int argc, char *argv[]) {
+#ifndef WIN32
+	if (argc > 1 && strcmp(argv[1], "stack") == 0) {
+		return host_stack();
+	}
+	if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+		return host_bench();
+	}
+	if (argc > 1 && strcmp(argv[1], "golden") == 0) {
+		return host_golden();
+	}
+	if (argc > 1 && strcmp(argv[1], "longrun") == 0) {
+		return host_longrun();
+	}
+	if (argc > 1 && strcmp(argv[1], "osc") == 0) {
+		return host_osc();
+	}
+	if (argc > 1 && strcmp(argv[1], "cull") == 0) {
+		return host_cull();
+	}
+	if (argc > 1 && strcmp(argv[1], "resume") == 0) {
+		return host_resume();
+	}
+	if (argc > 1 && strcmp(argv[1], "symmetry") == 0) {
+		return host_symmetry();
+	}
+#endif  // #ifndef WIN32
+	if (argc > 1 && strcmp(argv[1], "eeprom") == 0) {
+		return host_eeprom();
+	}
+	if (argc > 1 && strcmp(argv[1], "drivers") == 0) {
+		return host_drivers();
+	}
+	if (argc > 1 && strcmp(argv[1], "boot") == 0) {
+		return host_boot();
+	}
+	if (argc > 1 && strcmp(argv[1], "spsc") == 0) {
+		return host_spsc();
+	}
+	if (argc > 1 && strcmp(argv[1], "button") == 0) {
+		return host_button();
+	}
+	if (argc > 1 && strcmp(argv[1], "persist") == 0) {
+		return host_persist();
+	}
+	if (argc > 1 && strcmp(argv[1], "settings") == 0) {
+		return host_settings();
+	}
+	if (argc > 1 && strcmp(argv[1], "patterns") == 0) {
+		printf("pattern   animated   radial   keyframe ms   uniforms   state\n");
+		for (size_t p = 0; p < Patterns::count; p++) {
+			auto &info = Patterns::info[p];
+			printf("%7zu %10s %8s %13u %10u %7u\n", p, info.animated ? "yes" : "no", info.radial ? "yes" : "no", unsigned(info.keyframe_ms), unsigned(info.uniforms), unsigned(info.state));
+		}
+		printf("state arena: %zu bytes\n", Arena::size);
+		printf("radius classes: %zu of %zu LEDs\n", layout::radiusClassesN, Leds::ledsN);
+		return 0;
+	}
+	// Real time by default, "ff [speed]" fast-forwards the animation clock.
+	if (argc > 1 && strcmp(argv[1], "ff") == 0) {
+		Time::speed = argc > 2 ? uint32_t(atoi(argv[2])) : 10;
+	}
 	printf("\033[2J"); fflush(stdout);	
 	for(;;) {
 		HAL_SysTick_User();
@@ -0,0 +1,207 @@
+# Per-pattern flash and RAM from the linker map, and the largest stack frame
+# from the -fstack-usage output, for the pattern pack just linked. Fails when
+# the image is over the flash or RAM budget. Run after the link:
+#
+#   cmake -DMAP=<file.map> -DSU_DIR=<dir with .su files> -DPACK=<name>
+#         -DPATTERNS=<A,B,...> -DKERNELS=<K:A+B,...>
+#         -DFLASH_BUDGET=<bytes> -DRAM_BUDGET=<bytes> -P footprint.cmake
+#
+# With -ffunction-sections and -fdata-sections every function and static
+# gets its own input section named after its mangled symbol, which holds the
+# class name as <length><name>. Pattern code inlined into draw<P>() is still
+# counted for P. Looks draw through draw<Kernel>(), so a section that names
+# no pattern but a kernel is split evenly among the kernel's looks listed in
+# KERNELS. What no pattern or kernel name claims is the shared engine and HAL.
+
+string(REPLACE "," ";" PATTERNS "${PATTERNS}")
+string(REPLACE "," ";" kernel_entries "${KERNELS}")
+set(KERNELS "")
+foreach(entry IN LISTS kernel_entries)
+    if(entry MATCHES "^([A-Za-z0-9_]+):(.+)$")
+        set(kernel ${CMAKE_MATCH_1})
+        string(REPLACE "+" ";" looks_${kernel} "${CMAKE_MATCH_2}")
+        string(LENGTH "${kernel}" length)
+        set(token_${kernel} "${length}${kernel}")
+        list(APPEND KERNELS ${kernel})
+    endif()
+endforeach()
+
+function(hex_to_dec out hex)
+    math(EXPR value "0x${hex}" OUTPUT_FORMAT DECIMAL)
+    set(${out} ${value} PARENT_SCOPE)
+endfunction()
+
+file(STRINGS "${MAP}" lines REGEX "^( ?\\.[^ \t]+|[ \t]+0x[0-9a-f]+[ \t]+0x[0-9a-f]+|[A-Za-z_]+[ \t]+0x[0-9a-f]+[ \t]+0x[0-9a-f]+)")
+
+set(flash_origin -1)
+set(flash_end -1)
+set(ram_origin -1)
+set(ram_end -1)
+set(flash_used 0)
+set(ram_used 0)
+foreach(pattern IN LISTS PATTERNS)
+    string(LENGTH "${pattern}" length)
+    set(token_${pattern} "${length}${pattern}")
+    set(flash_${pattern} 0)
+    set(ram_${pattern} 0)
+    set(stack_${pattern} 0)
+endforeach()
+
+# Adds one input section to the pattern whose name it carries, or split
+# among the looks of the kernel it names, if any. The first look also gets
+# what does not split evenly.
+macro(attribute name address size)
+    hex_to_dec(a ${address})
+    hex_to_dec(s ${size})
+    if(s GREATER 0)
+        set(owners "")
+        foreach(pattern IN LISTS PATTERNS)
+            string(FIND "${name}" "${token_${pattern}}" at)
+            if(at GREATER -1)
+                set(owners ${pattern})
+                break()
+            endif()
+        endforeach()
+        if(NOT owners)
+            foreach(kernel IN LISTS KERNELS)
+                string(FIND "${name}" "${token_${kernel}}" at)
+                if(at GREATER -1)
+                    set(owners ${looks_${kernel}})
+                    break()
+                endif()
+            endforeach()
+        endif()
+        list(LENGTH owners n)
+        if(n GREATER 0)
+            math(EXPR share "${s} / ${n}")
+            math(EXPR rest "${s} - ${share} * ${n}")
+            foreach(pattern IN LISTS owners)
+                math(EXPR bytes "${share} + ${rest}")
+                set(rest 0)
+                if(a GREATER_EQUAL flash_origin AND a LESS flash_end)
+                    math(EXPR flash_${pattern} "${flash_${pattern}} + ${bytes}")
+                elseif(a GREATER_EQUAL ram_origin AND a LESS ram_end)
+                    math(EXPR ram_${pattern} "${ram_${pattern}} + ${bytes}")
+                    if(name MATCHES "^\\.data")
+                        math(EXPR flash_${pattern} "${flash_${pattern}} + ${bytes}")
+                    endif()
+                endif()
+            endforeach()
+        endif()
+    endif()
+endmacro()
+
+set(pending "")
+foreach(line IN LISTS lines)
+    if(line MATCHES "^(FLASH|RAM)[ \t]+0x([0-9a-f]+)[ \t]+0x([0-9a-f]+)")
+        hex_to_dec(origin ${CMAKE_MATCH_2})
+        hex_to_dec(length ${CMAKE_MATCH_3})
+        string(TOLOWER ${CMAKE_MATCH_1} region)
+        set(${region}_origin ${origin})
+        math(EXPR ${region}_end "${origin} + ${length}")
+    elseif(line MATCHES "^(\\.[^ \t]+)[ \t]+0x([0-9a-f]+)[ \t]+0x([0-9a-f]+)( load address 0x([0-9a-f]+))?")
+        # Output section: the totals.
+        hex_to_dec(a ${CMAKE_MATCH_2})
+        hex_to_dec(s ${CMAKE_MATCH_3})
+        set(load ${a})
+        if(CMAKE_MATCH_5)
+            hex_to_dec(load ${CMAKE_MATCH_5})
+        endif()
+        if(a GREATER_EQUAL ram_origin AND a LESS ram_end)
+            math(EXPR ram_used "${ram_used} + ${s}")
+        endif()
+        if(load GREATER_EQUAL flash_origin AND load LESS flash_end)
+            math(EXPR flash_used "${flash_used} + ${s}")
+        endif()
+        set(pending "")
+    elseif(line MATCHES "^ (\\.[^ \t]+)[ \t]+0x([0-9a-f]+)[ \t]+0x([0-9a-f]+)")
+        attribute("${CMAKE_MATCH_1}" ${CMAKE_MATCH_2} ${CMAKE_MATCH_3})
+        set(pending "")
+    elseif(line MATCHES "^ (\\.[^ \t]+)$")
+        # Long section names put the address and size on the next line.
+        set(pending "${CMAKE_MATCH_1}")
+    elseif(pending AND line MATCHES "^[ \t]+0x([0-9a-f]+)[ \t]+0x([0-9a-f]+)")
+        attribute("${pending}" ${CMAKE_MATCH_1} ${CMAKE_MATCH_2})
+        set(pending "")
+    endif()
+endforeach()
+
+if(flash_origin EQUAL -1 OR ram_origin EQUAL -1)
+    message(FATAL_ERROR "${MAP} has no FLASH and RAM memory regions")
+endif()
+
+# "<file>:<line>:<column>:<function>\t<bytes>\t<qualifiers>", the pattern is
+# either the class in the name or the template argument of draw<P>(). A
+# kernel's frames count for each of its looks.
+file(GLOB su_files "${SU_DIR}/*.su")
+foreach(su IN LISTS su_files)
+    file(STRINGS "${su}" entries)
+    foreach(entry IN LISTS entries)
+        if(entry MATCHES "^[^\t]*:[0-9]+:[0-9]+:([^\t]*)\t([0-9]+)\t")
+            set(function "${CMAKE_MATCH_1}")
+            set(bytes ${CMAKE_MATCH_2})
+            string(REGEX REPLACE "\\(.*\\)" "()" function "${function}")
+            set(owners "")
+            foreach(owner IN LISTS PATTERNS KERNELS)
+                if(function MATCHES "(^|[^A-Za-z0-9_])${owner}::" OR function MATCHES "= ${owner}[];]")
+                    if(DEFINED looks_${owner})
+                        list(APPEND owners ${looks_${owner}})
+                    else()
+                        list(APPEND owners ${owner})
+                    endif()
+                endif()
+            endforeach()
+            foreach(pattern IN LISTS owners)
+                if(bytes GREATER stack_${pattern})
+                    set(stack_${pattern} ${bytes})
+                endif()
+            endforeach()
+        endif()
+    endforeach()
+endforeach()
+
+# Appends text to var, right aligned in width columns, or left aligned for a
+# negative width.
+function(column var text width)
+    string(LENGTH "${text}" length)
+    if(width LESS 0)
+        math(EXPR fill "-${width} - ${length}")
+    else()
+        math(EXPR fill "${width} - ${length}")
+    endif()
+    set(padding "")
+    if(fill GREATER 0)
+        string(REPEAT " " ${fill} padding)
+    endif()
+    if(width LESS 0)
+        set(${var} "${${var}}${text}${padding}" PARENT_SCOPE)
+    else()
+        set(${var} "${${var}}${padding}${text}" PARENT_SCOPE)
+    endif()
+endfunction()
+
+set(report "pattern pack ${PACK}\n  pattern       flash    RAM  largest frame\n")
+set(flash_patterns 0)
+set(ram_patterns 0)
+foreach(pattern IN LISTS PATTERNS)
+    string(APPEND report "  ")
+    column(report "${pattern}" -12)
+    column(report "${flash_${pattern}}" 7)
+    column(report "${ram_${pattern}}" 7)
+    column(report "${stack_${pattern}}" 15)
+    string(APPEND report "\n")
+    math(EXPR flash_patterns "${flash_patterns} + ${flash_${pattern}}")
+    math(EXPR ram_patterns "${ram_patterns} + ${ram_${pattern}}")
+endforeach()
+math(EXPR flash_shared "${flash_used} - ${flash_patterns}")
+math(EXPR ram_shared "${ram_used} - ${ram_patterns}")
+string(APPEND report "  patterns ${flash_patterns} flash ${ram_patterns} RAM, shared ${flash_shared} flash ${ram_shared} RAM\n")
+string(APPEND report "  total ${flash_used} of ${FLASH_BUDGET} flash, ${ram_used} of ${RAM_BUDGET} RAM\n")
+message("${report}")
+
+if(flash_used GREATER FLASH_BUDGET)
+    message(FATAL_ERROR "Pattern pack ${PACK} needs ${flash_used} bytes of flash, the budget is ${FLASH_BUDGET}")
+endif()
+if(ram_used GREATER RAM_BUDGET)
+    message(FATAL_ERROR "Pattern pack ${PACK} needs ${ram_used} bytes of RAM, the budget is ${RAM_BUDGET}")
+endif()
@@ -0,0 +1,53 @@
+# Pattern packs. Each pack is a list of pattern classes from capn-blinky.cpp
+# in the order the button steps through them. Pick one with
+# -DCAPN_PACK=<name>. The build generates pack.h from it and reports the
+# flash and RAM each pattern takes.
+set(CAPN_PACKS all classic calm party)
+
+set(CAPN_PACK_all Sweep HueCycle Spin Diagonal Scroll Sparkle Confetti Gradient Glow Ripple)
+set(CAPN_PACK_classic Sweep HueCycle Spin Diagonal Scroll Sparkle Confetti Gradient Glow)
+set(CAPN_PACK_calm HueCycle Scroll Gradient Glow Ripple)
+set(CAPN_PACK_party Sweep Spin Diagonal Sparkle Confetti Ripple)
+
+# Kernels and the looks that run on them. A look's code is mostly its
+# kernel's, the footprint report splits that evenly among the looks in the
+# pack.
+set(CAPN_KERNELS GradientKernel HueScrollKernel SweepKernel SparkleKernel)
+
+set(CAPN_KERNEL_GradientKernel Gradient)
+set(CAPN_KERNEL_HueScrollKernel HueCycle Diagonal Scroll)
+set(CAPN_KERNEL_SweepKernel Sweep)
+set(CAPN_KERNEL_SparkleKernel Sparkle Confetti)
+
+set(CAPN_PACK "all" CACHE STRING "Pattern pack to build, one of: ${CAPN_PACKS}")
+set_property(CACHE CAPN_PACK PROPERTY STRINGS ${CAPN_PACKS})
+if(NOT CAPN_PACK IN_LIST CAPN_PACKS)
+    list(JOIN CAPN_PACKS ", " packs)
+    message(FATAL_ERROR "Unknown pattern pack '${CAPN_PACK}', pick one of: ${packs}")
+endif()
+
+set(CAPN_PACK_PATTERNS ${CAPN_PACK_${CAPN_PACK}})
+list(TRANSFORM CAPN_PACK_PATTERNS PREPEND "class " OUTPUT_VARIABLE CAPN_PACK_CLASSES)
+list(JOIN CAPN_PACK_CLASSES ", " CAPN_PACK_CLASSES)
+message(STATUS "Pattern pack ${CAPN_PACK}: ${CAPN_PACK_PATTERNS}")
+
+# The kernels this pack uses, each as <kernel>:<look>+<look> with its looks
+# in the pack.
+set(CAPN_PACK_KERNELS "")
+foreach(kernel IN LISTS CAPN_KERNELS)
+    set(looks "")
+    foreach(look IN LISTS CAPN_KERNEL_${kernel})
+        if(look IN_LIST CAPN_PACK_PATTERNS)
+            list(APPEND looks ${look})
+        endif()
+    endforeach()
+    if(looks)
+        list(JOIN looks "+" looks)
+        list(APPEND CAPN_PACK_KERNELS "${kernel}:${looks}")
+    endif()
+endforeach()
+
+# Budgets the footprint report checks, default the whole part. Lower them to
+# keep headroom for the next pattern.
+set(CAPN_FLASH_BUDGET 8192 CACHE STRING "Flash bytes a pack may use")
+set(CAPN_RAM_BUDGET 2048 CACHE STRING "RAM bytes a pack may use, stack reserve included")
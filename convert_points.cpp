@@ -2,10 +2,19 @@
 #include <algorithm>
 #include <iostream>
 #include <stdio.h>
+#include <stdlib.h>
 #include <math.h>
 #include <vector>
 #include <tuple>
 
+// Generates layout.h from the LED positions on the board: normalized
+// coordinates for Leds, the neighbour graph for Graph and the radius classes
+// for Radial. Runs at build time,
+//
+//   ./convert_points layout.h
+//
+// and writes to stdout without an argument.
+
 constexpr size_t ledsN = 12;
 
 double array[ledsN*2] = {
@@ -23,7 +32,19 @@ double array[ledsN*2] = {
      8.5800,22.7330, // 11  U1
 };
 
-int main() {
+// Neighbours per LED before the graph is made symmetric.
+constexpr size_t nearestK = 3;
+
+int main(int argc, char *argv[]) {
+    FILE *out = stdout;
+    if (argc > 1) {
+        out = fopen(argv[1], "w");
+        if (!out) {
+            perror(argv[1]);
+            return 1;
+        }
+    }
+
     double xmin = +100000.0;
     double xmax = -100000.0;
     double ymin = +100000.0;
@@ -41,8 +62,6 @@ int main() {
                  array[ 9*2+1] +
                  array[ 5*2+1]) / 4;
 
-    printf("%f %f\n", cx, cy);
-
     for (size_t c = 0; c < ledsN; c++) {
 
         xmin = std::min(xmin, array[c*2+0]);
@@ -66,13 +85,116 @@ int main() {
 
     std::reverse(coords.begin(),coords.end());
 
+    // Board positions in mm, in the same (reversed) order.
+    std::vector<std::pair<double, double>> mm;
+    for (size_t c = 0; c < ledsN; c++) {
+        mm.push_back({array[(ledsN - 1 - c)*2+0], array[(ledsN - 1 - c)*2+1]});
+    }
+
+    // k nearest neighbours by distance on the board, then made symmetric so
+    // light spreads the same way in both directions.
+    std::vector<std::vector<size_t>> adjacent(ledsN);
     for (size_t c = 0; c < ledsN; c++) {
-        printf("    {fixed32<24>(%14.12ff), fixed32<24>(%14.12ff), fixed32<24>(%14.12ff), fixed32<24>(%14.12ff)},\n", 
-            std::get<0>(coords[c]),
-            std::get<1>(coords[c]),
-            std::get<2>(coords[c]),
-            std::get<3>(coords[c]));
+        std::vector<std::pair<double, size_t>> by_distance;
+        for (size_t o = 0; o < ledsN; o++) {
+            if (o != c) {
+                by_distance.push_back({hypot(mm[o].first - mm[c].first, mm[o].second - mm[c].second), o});
+            }
+        }
+        std::sort(by_distance.begin(), by_distance.end());
+        for (size_t n = 0; n < std::min(nearestK, by_distance.size()); n++) {
+            adjacent[c].push_back(by_distance[n].second);
+            adjacent[by_distance[n].second].push_back(c);
+        }
+    }
+    size_t edges = 0;
+    for (auto &a : adjacent) {
+        std::sort(a.begin(), a.end());
+        a.erase(std::unique(a.begin(), a.end()), a.end());
+        edges += a.size();
     }
 
+    fprintf(out, "// Generated by convert_points.cpp, do not edit.\n");
+    fprintf(out, "#ifndef LAYOUT_H_\n");
+    fprintf(out, "#define LAYOUT_H_\n\n");
+    fprintf(out, "#include <stddef.h>\n");
+    fprintf(out, "#include <stdint.h>\n\n");
+    fprintf(out, "// Centre %f %f mm.\n", cx, cy);
+    fprintf(out, "namespace layout {\n\n");
+    fprintf(out, "constexpr size_t ledsN = %zu;\n", ledsN);
+
+    // One array per attribute, matching the layout in Leds.
+    auto column = [&](const char *name, auto get) {
+        fprintf(out, "\nconstexpr float %s[ledsN] = {\n", name);
+        for (size_t c = 0; c < ledsN; c++) {
+            fprintf(out, "%s%14.12ff%s", c % 4 == 0 ? "    " : "", get(coords[c]),
+                c == ledsN - 1 ? "\n" : c % 4 == 3 ? ",\n" : ", ");
+        }
+        fprintf(out, "};\n");
+    };
+
+    column("x", [](auto &t) { return std::get<0>(t); });
+    column("y", [](auto &t) { return std::get<1>(t); });
+    column("radius", [](auto &t) { return std::get<2>(t); });
+    column("angle", [](auto &t) { return std::get<3>(t); });
+
+    // CSR: the neighbours of LED c are neighbours[offsets[c]] up to
+    // neighbours[offsets[c + 1]]. Indices are 8 bits up to 256 LEDs.
+    const char *index_type = ledsN <= 256 ? "uint8_t" : "uint16_t";
+    const char *offset_type = edges <= 255 ? "uint8_t" : "uint16_t";
+    fprintf(out, "\nconstexpr size_t edgesN = %zu;\n", edges);
+    fprintf(out, "\nconstexpr %s offsets[ledsN + 1] = {\n", offset_type);
+    for (size_t c = 0, o = 0; c <= ledsN; c++) {
+        fprintf(out, "%s%zu%s", c % 8 == 0 ? "    " : "", o, c == ledsN ? "\n" : c % 8 == 7 ? ",\n" : ", ");
+        if (c < ledsN) {
+            o += adjacent[c].size();
+        }
+    }
+    fprintf(out, "};\n");
+    fprintf(out, "\nconstexpr %s neighbours[edgesN] = {\n", index_type);
+    for (size_t c = 0; c < ledsN; c++) {
+        fprintf(out, "    ");
+        for (size_t n = 0; n < adjacent[c].size(); n++) {
+            fprintf(out, "%zu%s", adjacent[c][n], c == ledsN - 1 && n == adjacent[c].size() - 1 ? "" : n == adjacent[c].size() - 1 ? "," : ", ");
+        }
+        fprintf(out, "   // %zu\n", c);
+    }
+    fprintf(out, "};\n");
+
+    // LEDs whose radius comes out as the same fixed32<20> in Leds, so
+    // patterns that only depend on the radius can shade one LED per class.
+    // The key is the float literal above, read back and converted the way
+    // the fixed32 float constructor does it.
+    std::vector<int32_t> keys;
+    std::vector<size_t> radius_class(ledsN);
+    std::vector<size_t> radius_lead;
+    for (size_t c = 0; c < ledsN; c++) {
+        char literal[32];
+        snprintf(literal, sizeof(literal), "%14.12f", std::get<2>(coords[c]));
+        int32_t key = int32_t(strtof(literal, nullptr) * float(1L << 20));
+        size_t k = size_t(std::find(keys.begin(), keys.end(), key) - keys.begin());
+        if (k == keys.size()) {
+            keys.push_back(key);
+            radius_lead.push_back(c);
+        }
+        radius_class[c] = k;
+    }
+    fprintf(out, "\nconstexpr size_t radiusClassesN = %zu;\n", radius_lead.size());
+    fprintf(out, "\nconstexpr %s radius_class[ledsN] = {\n", index_type);
+    for (size_t c = 0; c < ledsN; c++) {
+        fprintf(out, "%s%zu%s", c % 8 == 0 ? "    " : "", radius_class[c], c == ledsN - 1 ? "\n" : c % 8 == 7 ? ",\n" : ", ");
+    }
+    fprintf(out, "};\n");
+    fprintf(out, "\nconstexpr %s radius_lead[radiusClassesN] = {\n", index_type);
+    for (size_t k = 0; k < radius_lead.size(); k++) {
+        fprintf(out, "%s%zu%s", k % 8 == 0 ? "    " : "", radius_lead[k], k == radius_lead.size() - 1 ? "\n" : k % 8 == 7 ? ",\n" : ", ");
+    }
+    fprintf(out, "};\n\n");
+    fprintf(out, "}  // namespace layout\n\n");
+    fprintf(out, "#endif  // #ifndef LAYOUT_H_\n");
+
+    if (out != stdout) {
+        fclose(out);
+    }
     return 0;
 }
@@ -0,0 +1,255 @@
+// Register-level drivers for what runs every frame or in an interrupt: SPI1
+// transmit DMA for the LEDs, the PB1 button on EXTI line 1, data EEPROM
+// programming and a millisecond clock between SysTick interrupts. Setup stays with CubeMX and the HAL (MX_SPI1_Init,
+// MX_DMA_Init, MX_GPIO_Init), these only do the per-call work.
+//
+// The drivers use the CMSIS register names. On the target those are the
+// device header's; on the host they point into a mock register file that
+// logs every access, so the drivers can be tested off target.
+#ifndef DRIVERS_H_
+#define DRIVERS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef USE_HAL_DRIVER
+namespace mock {
+
+struct Access {
+    const void *reg;
+    uint32_t value;
+    bool write;
+};
+
+struct Log {
+    static constexpr size_t depth = 32;
+    Access entries[depth];
+    uint32_t reads;
+    uint32_t writes;
+
+    void clear() {
+        reads = 0;
+        writes = 0;
+    }
+
+    void add(const void *reg, uint32_t value, bool write) {
+        uint32_t n = reads + writes;
+        if (n < depth) {
+            entries[n] = { reg, value, write };
+        }
+        (write ? writes : reads)++;
+    }
+};
+
+inline Log log;
+
+// A register, logs every read and write.
+class Reg {
+public:
+    operator uint32_t() const {
+        log.add(this, value, false);
+        return value;
+    }
+
+    Reg &operator=(uint32_t v) {
+        value = v;
+        log.add(this, value, true);
+        return *this;
+    }
+
+    Reg &operator|=(uint32_t v) { return *this = uint32_t(*this) | v; }
+    Reg &operator&=(uint32_t v) { return *this = uint32_t(*this) & v; }
+
+    // Test access, not logged.
+    uint32_t value = 0;
+};
+
+struct SPI_TypeDef { Reg CR1, CR2, SR, DR; };
+struct DMA_TypeDef { Reg ISR, IFCR; };
+struct DMA_Channel_TypeDef { Reg CCR, CNDTR, CPAR, CMAR; };
+struct EXTI_TypeDef { Reg IMR, EMR, RTSR, FTSR, SWIER, PR; };
+struct GPIO_TypeDef { Reg IDR; };
+struct FLASH_TypeDef { Reg ACR, PECR, PDKEYR, PEKEYR, PRGKEYR, OPTKEYR, SR; };
+struct SysTick_Type { Reg CTRL, LOAD, VAL, CALIB; };
+struct SCB_Type { Reg CPUID, ICSR; };
+
+struct Registers {
+    SPI_TypeDef spi1;
+    DMA_TypeDef dma1;
+    DMA_Channel_TypeDef dma1_channel3;
+    EXTI_TypeDef exti;
+    GPIO_TypeDef gpiob;
+    FLASH_TypeDef flash;
+    SysTick_Type systick;
+    SCB_Type scb;
+    Reg eeprom[128];
+};
+
+inline Registers registers;
+
+}  // namespace mock
+
+#define SPI1 (&mock::registers.spi1)
+#define DMA1 (&mock::registers.dma1)
+#define DMA1_Channel3 (&mock::registers.dma1_channel3)
+#define EXTI (&mock::registers.exti)
+#define GPIOB (&mock::registers.gpiob)
+#define FLASH (&mock::registers.flash)
+#define SysTick (&mock::registers.systick)
+#define SCB (&mock::registers.scb)
+
+// Bit values from stm32l011xx.h, 32 bits wide as on the target.
+#define SPI_CR1_SPE (1U << 6)
+#define SPI_CR2_TXDMAEN (1U << 1)
+#define DMA_ISR_TCIF3 (1U << 9)
+#define DMA_IFCR_CGIF3 (1U << 8)
+#define DMA_CCR_EN (1U << 0)
+#define DMA_CCR_TCIE (1U << 1)
+#define EXTI_PR_PIF1 (1U << 1)
+#define GPIO_IDR_ID1 (1U << 1)
+#define FLASH_PECR_PELOCK (1U << 0)
+#define FLASH_SR_BSY (1U << 0)
+#define FLASH_SR_WRPERR (1U << 8)
+#define FLASH_SR_PGAERR (1U << 9)
+#define FLASH_SR_SIZERR (1U << 10)
+#define FLASH_SR_OPTVERR (1U << 11)
+#define FLASH_SR_RDERR (1U << 13)
+#define FLASH_SR_NOTZEROERR (1U << 16)
+#define FLASH_SR_FWWERR (1U << 17)
+#define SCB_ICSR_PENDSTSET_Msk (1U << 26)
+#endif  // #ifndef USE_HAL_DRIVER
+
+namespace drivers {
+
+// SPI1 transmit on DMA1 channel 3. MX_DMA_Init and the SPI MSP init set the
+// channel's direction, increments, priority and request mapping once.
+class SpiDma {
+public:
+    // Starts sending size bytes, cutting short a transfer still running.
+    static void start(const uint8_t *data, uint16_t size) {
+        DMA1_Channel3->CCR &= ~DMA_CCR_EN;
+        DMA1->IFCR = DMA_IFCR_CGIF3;
+        DMA1_Channel3->CNDTR = size;
+        DMA1_Channel3->CPAR = uint32_t(reinterpret_cast<uintptr_t>(&SPI1->DR));
+        DMA1_Channel3->CMAR = uint32_t(reinterpret_cast<uintptr_t>(data));
+        DMA1_Channel3->CCR |= DMA_CCR_TCIE | DMA_CCR_EN;
+        SPI1->CR2 |= SPI_CR2_TXDMAEN;
+        SPI1->CR1 |= SPI_CR1_SPE;
+    }
+
+    // From the DMA1 channel 2/3 interrupt. True when the transfer finished.
+    static bool irq() {
+        bool complete = (DMA1->ISR & DMA_ISR_TCIF3) != 0;
+        DMA1->IFCR = DMA_IFCR_CGIF3;
+        return complete;
+    }
+};
+
+// The button on PB1, EXTI line 1 on both edges. Pulled up, low while pressed.
+class ButtonLine {
+public:
+    // From the EXTI line 0/1 interrupt. True with the level if line 1 fired.
+    static bool irq(bool &pressed) {
+        if ((EXTI->PR & EXTI_PR_PIF1) == 0) {
+            return false;
+        }
+        EXTI->PR = EXTI_PR_PIF1;
+        pressed = (GPIOB->IDR & GPIO_IDR_ID1) == 0;
+        return true;
+    }
+};
+
+// Data EEPROM, programmed one word at a time. Flash reads stall while a word
+// is being programmed, there is only one bank.
+class DataEeprom {
+public:
+    static constexpr uint32_t errors = FLASH_SR_WRPERR | FLASH_SR_PGAERR | FLASH_SR_SIZERR |
+        FLASH_SR_OPTVERR | FLASH_SR_RDERR | FLASH_SR_NOTZEROERR | FLASH_SR_FWWERR;
+
+    static uint32_t read(size_t word) {
+        return words()[word];
+    }
+
+    static void unlock() {
+        if ((FLASH->PECR & FLASH_PECR_PELOCK) != 0) {
+            FLASH->PEKEYR = 0x89ABCDEF;
+            FLASH->PEKEYR = 0x02030405;
+        }
+    }
+
+    static void lock() {
+        FLASH->PECR |= FLASH_PECR_PELOCK;
+    }
+
+    static bool busy() {
+        return (FLASH->SR & FLASH_SR_BSY) != 0;
+    }
+
+    // Only when unlocked and not busy(). Returns while the word is still
+    // being programmed.
+    static void start(size_t word, uint32_t value) {
+        words()[word] = value;
+    }
+
+    // Once not busy() after start(). False if the controller flagged an
+    // error, which is then cleared.
+    static bool succeeded() {
+        uint32_t sr = FLASH->SR;
+        if ((sr & errors) != 0) {
+            FLASH->SR = sr & errors;
+            return false;
+        }
+        return true;
+    }
+
+    // Only when unlocked. Waits for the word to be programmed, false if the
+    // controller flagged an error.
+    static bool program(size_t word, uint32_t value) {
+        while (busy()) {
+        }
+        start(word, value);
+        while (busy()) {
+        }
+        return succeeded();
+    }
+
+private:
+#ifdef USE_HAL_DRIVER
+    static volatile uint32_t *words() {
+        return reinterpret_cast<volatile uint32_t *>(DATA_EEPROM_BASE);
+    }
+#else  // #ifdef USE_HAL_DRIVER
+    static mock::Reg *words() {
+        return mock::registers.eeprom;
+    }
+#endif  // #ifdef USE_HAL_DRIVER
+};
+
+// HAL's tick plus the part of the current period SysTick has counted down,
+// so interrupts between ticks get their own time. Works from an interrupt
+// that preempts SysTick: a wrap the handler has not counted yet is pending.
+class SysTickClock {
+public:
+    // tick is HAL's uwTick, which steps by period_ms.
+    static uint32_t ms(const volatile uint32_t &tick, uint32_t period_ms) {
+        uint32_t before;
+        uint32_t elapsed;
+        do {
+            before = tick;
+            uint32_t load = SysTick->LOAD;
+            uint32_t val = SysTick->VAL;
+            elapsed = 0;
+            if ((SCB->ICSR & SCB_ICSR_PENDSTSET_Msk) != 0) {
+                // VAL may be from before the wrap, read it again.
+                val = SysTick->VAL;
+                elapsed = period_ms;
+            }
+            elapsed += (load - val) * period_ms / (load + 1);
+        } while (tick != before);
+        return before + elapsed;
+    }
+};
+
+}  // namespace drivers
+
+#endif  // #ifndef DRIVERS_H_
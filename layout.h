@@ -0,0 +1,73 @@
+// Generated by convert_points.cpp, do not edit.
+#ifndef LAYOUT_H_
+#define LAYOUT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Centre 25.516750 48.482250 mm.
+namespace layout {
+
+constexpr size_t ledsN = 12;
+
+constexpr float x[ledsN] = {
+    0.000000000000f, 0.091880693216f, 0.300700450525f, 0.300700450525f,
+    0.173073761058f, 0.557302114506f, 0.818573448650f, 1.000000000000f,
+    0.753592686376f, 0.701141109540f, 0.405965339209f, 0.354993587425f
+};
+
+constexpr float y[ledsN] = {
+    0.000000000000f, 0.197963213135f, 0.531201288579f, 0.240855242648f,
+    0.405824586927f, 0.392627039385f, 0.534500675465f, 0.428920295126f,
+    0.808349786969f, 0.999350514393f, 1.000000000000f, 0.801751013198f
+};
+
+constexpr float radius[ledsN] = {
+    1.000000000000f, 0.772332122866f, 0.356442638758f, 0.557331634801f,
+    0.561155449758f, 0.292085112127f, 0.361259521513f, 0.617041966382f,
+    0.289876914397f, 0.394305272030f, 0.399002657007f, 0.292326727774f
+};
+
+constexpr float angle[ledsN] = {
+    0.785398163398f, 0.700511333882f, 0.420808961092f, 0.947448246866f,
+    0.518578517019f, 1.572261434407f, 2.737267656516f, 2.717833619879f,
+    3.674825514208f, 4.229642688686f, 5.213568293370f, 5.782303428300f
+};
+
+constexpr size_t edgesN = 42;
+
+constexpr uint8_t offsets[ledsN + 1] = {
+    0, 3, 6, 9, 13, 17, 21, 24,
+    27, 32, 35, 38, 42
+};
+
+constexpr uint8_t neighbours[edgesN] = {
+    1, 3, 4,   // 0
+    0, 3, 4,   // 1
+    4, 5, 11,   // 2
+    0, 1, 4, 5,   // 3
+    0, 1, 2, 3,   // 4
+    2, 3, 6, 7,   // 5
+    5, 7, 8,   // 6
+    5, 6, 8,   // 7
+    6, 7, 9, 10, 11,   // 8
+    8, 10, 11,   // 9
+    8, 9, 11,   // 10
+    2, 8, 9, 10   // 11
+};
+
+constexpr size_t radiusClassesN = 12;
+
+constexpr uint8_t radius_class[ledsN] = {
+    0, 1, 2, 3, 4, 5, 6, 7,
+    8, 9, 10, 11
+};
+
+constexpr uint8_t radius_lead[radiusClassesN] = {
+    0, 1, 2, 3, 4, 5, 6, 7,
+    8, 9, 10, 11
+};
+
+}  // namespace layout
+
+#endif  // #ifndef LAYOUT_H_
@@ -0,0 +1,200 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+// Decodes the Trace ring and the Perf block from a RAM dump, e.g.:
+//
+//   openocd -f stlink.cfg -f stm32l0.cfg -c "init; halt; dump_image ram.bin 0x20000000 0x800; exit"
+//   ./trace_decode ram.bin
+//
+// Must match Trace and Perf in capn-blinky.cpp.
+constexpr uint32_t traceMagic = 0x45435254;
+constexpr size_t traceDepth = 16;
+constexpr uint32_t perfMagic = 0x46524550;
+constexpr size_t isrsN = 3;
+
+enum Event : uint8_t {
+    ButtonEdge = 1,
+    PatternChange = 2,
+    EepromSave = 3,
+    DmaStart = 4,
+    PatternFrame = 5,
+};
+
+static const char *event_name(uint8_t event) {
+    switch (event) {
+        case ButtonEdge: return "button-edge";
+        case PatternChange: return "pattern-change";
+        case EepromSave: return "eeprom-save";
+        case DmaStart: return "dma-start";
+        case PatternFrame: return "pattern-frame";
+        default: return "unknown";
+    }
+}
+
+struct Entry {
+    uint64_t time;
+    uint8_t event;
+    uint8_t arg;
+};
+
+struct Stat {
+    const char *name;
+    std::vector<uint64_t> samples;
+
+    void print() const {
+        if (samples.empty()) {
+            printf("  %-30s      n/a\n", name);
+            return;
+        }
+        uint64_t sum = 0;
+        for (auto s : samples) {
+            sum += s;
+        }
+        printf("  %-30s n=%-3zu min=%-5llu avg=%-5llu max=%-5llu ms\n", name, samples.size(),
+            (unsigned long long)*std::min_element(samples.begin(), samples.end()),
+            (unsigned long long)(sum / samples.size()),
+            (unsigned long long)*std::max_element(samples.begin(), samples.end()));
+    }
+};
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        printf("usage: %s ram.bin [base_address]\n", argv[0]);
+        return 1;
+    }
+
+    uint32_t base = argc > 2 ? uint32_t(strtoul(argv[2], nullptr, 0)) : 0x20000000;
+
+    FILE *f = fopen(argv[1], "rb");
+    if (!f) {
+        perror(argv[1]);
+        return 1;
+    }
+    std::vector<uint8_t> dump;
+    uint8_t buf[4096];
+    for (size_t n; (n = fread(buf, 1, sizeof(buf), f)) > 0; ) {
+        dump.insert(dump.end(), buf, buf + n);
+    }
+    fclose(f);
+
+    auto word = [&](size_t offset) {
+        return uint32_t(dump[offset + 0]) << 0 | uint32_t(dump[offset + 1]) << 8 |
+               uint32_t(dump[offset + 2]) << 16 | uint32_t(dump[offset + 3]) << 24;
+    };
+
+    auto half = [&](size_t offset) {
+        return unsigned(dump[offset + 0]) << 0 | unsigned(dump[offset + 1]) << 8;
+    };
+
+    auto find = [&](uint32_t magic, size_t size, size_t &offset) {
+        for (size_t c = 0; c + size <= dump.size(); c += 4) {
+            if (word(c) == magic) {
+                offset = c;
+                return true;
+            }
+        }
+        return false;
+    };
+
+    // The block holds as many patterns as the pack that was built.
+    size_t perf = 0;
+    bool has_perf = find(perfMagic, 6, perf) && perf + 6 + (half(perf + 4) + isrsN + 2) * 2 <= dump.size();
+    if (has_perf) {
+        size_t patternsN = half(perf + 4);
+        printf("stack depth (bytes from top of RAM):\n");
+        for (size_t c = 0; c < patternsN; c++) {
+            printf("  pattern %zu %5u\n", c, half(perf + 6 + c * 2));
+        }
+        const char *isrs[isrsN] = { "systick", "exti", "dma" };
+        for (size_t c = 0; c < isrsN; c++) {
+            printf("  %-9s %5u\n", isrs[c], half(perf + 6 + (patternsN + c) * 2));
+        }
+        printf("frames dropped: %u\n", half(perf + 6 + (patternsN + isrsN) * 2));
+        printf("frames cut:     %u\n", half(perf + 6 + (patternsN + isrsN + 1) * 2));
+        printf("\n");
+    }
+
+    // Release builds leave the ring out unless built with CAPN_TRACE=ON.
+    size_t ring = 0;
+    if (!find(traceMagic, (traceDepth + 2) * 4, ring)) {
+        printf("no trace ring found in %s\n", argv[1]);
+        return has_perf ? 0 : 1;
+    }
+
+    uint32_t head = word(ring + 4);
+    size_t count = std::min(size_t(head), traceDepth);
+    printf("trace ring at 0x%08x, %u events recorded, %zu retained\n\n", unsigned(base + ring), unsigned(head), count);
+
+    // Timestamps are 16-bit milliseconds, unwrap assuming entries are less
+    // than 65s apart. The 100Hz DmaStart stream keeps that true while running.
+    std::vector<Entry> entries;
+    uint64_t time = 0;
+    uint32_t prev = 0;
+    for (size_t c = 0; c < count; c++) {
+        uint32_t e = word(ring + 8 + ((head - count + c) & (traceDepth - 1)) * 4);
+        uint32_t stamp = e >> 16;
+        if (c != 0) {
+            time += (stamp - prev) & 0xFFFF;
+        }
+        prev = stamp;
+        entries.push_back({time, uint8_t(e & 0xFF), uint8_t((e >> 8) & 0xFF)});
+    }
+
+    for (auto &e : entries) {
+        if (e.event == DmaStart) {
+            printf("%10llu ms  %-16s x%u\n", (unsigned long long)e.time, event_name(e.event), unsigned(e.arg) + 1);
+        } else {
+            printf("%10llu ms  %-16s %u\n", (unsigned long long)e.time, event_name(e.event), unsigned(e.arg));
+        }
+    }
+
+    Stat press_to_change = { "button-edge -> pattern-change", {} };
+    Stat change_to_frame = { "pattern-change -> frame", {} };
+    Stat press_to_frame = { "button-edge -> frame", {} };
+    Stat change_to_save = { "pattern-change -> eeprom", {} };
+
+    const Entry *press = nullptr;
+    const Entry *change = nullptr;
+    for (auto &e : entries) {
+        switch (e.event) {
+            case ButtonEdge:
+                if (!press) {
+                    press = &e;
+                }
+                break;
+            case PatternChange:
+                if (press) {
+                    press_to_change.samples.push_back(e.time - press->time);
+                }
+                change = &e;
+                break;
+            case EepromSave:
+                if (change) {
+                    change_to_save.samples.push_back(e.time - change->time);
+                }
+                break;
+            case PatternFrame:
+                if (change) {
+                    change_to_frame.samples.push_back(e.time - change->time);
+                }
+                if (press) {
+                    press_to_frame.samples.push_back(e.time - press->time);
+                }
+                press = nullptr;
+                change = nullptr;
+                break;
+        }
+    }
+
+    printf("\nlatency:\n");
+    press_to_change.print();
+    change_to_save.print();
+    change_to_frame.print();
+    press_to_frame.print();
+
+    return 0;
+}